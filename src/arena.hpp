@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
 class ArenaAllocator
 {
     public:
@@ -13,11 +18,37 @@ class ArenaAllocator
         template<typename T>
         T* alloc()
         {
-            void *offset =m_offset;
-            m_offset += sizeof(T);
-            return static_cast<T*>(offset);
+            // empty nodes are 1 byte, the next one still has to start aligned
+            const size_t start = (high_water() + alignof(T) - 1) / alignof(T) * alignof(T);
+            if (start > m_size || sizeof(T) > m_size - start)
+            {
+                std::cerr << "Parser arena exhausted (" << m_size << " bytes), the program is too large" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            void *offset = m_buffer + start;
+            m_offset = m_buffer + start + sizeof(T);
+            m_allocations++;
+            // construct in place, nodes hold strings and vectors that must not
+            // start out as whatever the last parse left in reused heap memory
+            return new (offset) T();
+        }
+
+
+        // nothing is ever freed back, so bytes in use is also the high-water mark
+        [[nodiscard]] size_t high_water() const
+        {
+            return static_cast<size_t>(m_offset - m_buffer);
         }
 
+        [[nodiscard]] size_t allocations() const
+        {
+            return m_allocations;
+        }
+
+        [[nodiscard]] size_t capacity() const
+        {
+            return m_size;
+        }
 
         ArenaAllocator(const ArenaAllocator &other) = delete;
         ArenaAllocator operator=(const ArenaAllocator &other) = delete;
@@ -32,4 +63,5 @@ class ArenaAllocator
         size_t m_size;
         std::byte *m_buffer;
         std::byte *m_offset;
+        size_t m_allocations = 0;
 };
\ No newline at end of file
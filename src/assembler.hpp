@@ -0,0 +1,914 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// assembles the NASM subset the Generator emits into raw section bytes, symbols
+// and fixups, for the JIT. every branch and rip-relative reference uses a 32-bit
+// displacement, so instruction sizes are known up front and a single pass is enough
+enum class SectionKind {text, rodata, data, bss};
+
+struct AsmSection
+{
+    std::string name;
+    SectionKind kind;
+    size_t align = 16;
+    std::vector<uint8_t> bytes = {};
+    // bss only reserves space, it has no bytes
+    size_t bss_size = 0;
+
+    [[nodiscard]] size_t size() const
+    {
+        return kind == SectionKind::bss ? bss_size : bytes.size();
+    }
+};
+
+struct AsmSymbol
+{
+    size_t section;
+    size_t offset;
+};
+
+struct AsmFixup
+{
+    // rel32: `target - next_ip` stored at `offset`, abs64: absolute address of `target`
+    enum class Kind {rel32, abs64} kind;
+    size_t section = 0;
+    size_t offset = 0;
+    size_t next_ip = 0;
+    std::string symbol = {};
+    int64_t addend = 0;
+    // extern reached through its address slot (`call [rel slot]`) rather than directly
+    bool via_slot = false;
+};
+
+class Assembler
+{
+public:
+    explicit Assembler(std::string src)
+        : m_src(std::move(src)) {}
+
+    void assemble()
+    {
+        m_current = section(".text");
+        std::stringstream lines(m_src);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            m_line++;
+            assemble_line(strip_comment(line));
+        }
+    }
+
+    [[nodiscard]] const std::vector<AsmSection> &sections() const { return m_sections; }
+    [[nodiscard]] const std::unordered_map<std::string, AsmSymbol> &symbols() const { return m_symbols; }
+    [[nodiscard]] const std::vector<AsmFixup> &fixups() const { return m_fixups; }
+    [[nodiscard]] const std::vector<std::string> &externs() const { return m_externs; }
+
+private:
+    struct Operand
+    {
+        enum class Kind {reg, mem, imm} kind;
+        // bits, 0 when a memory operand has no size keyword
+        int size = 0;
+        int reg = -1;
+        // memory: [base + index * scale + label + disp]
+        int base = -1;
+        int index = -1;
+        int scale = 1;
+        std::string label;
+        int64_t disp = 0;
+    };
+
+    [[noreturn]] void fail(const std::string &msg) const
+    {
+        std::cerr << "JIT assembler, line " << m_line << ": " << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    static std::string trim(const std::string &s)
+    {
+        const size_t begin = s.find_first_not_of(" \t\r");
+        if (begin == std::string::npos)
+            return "";
+        const size_t end = s.find_last_not_of(" \t\r");
+        return s.substr(begin, end - begin + 1);
+    }
+
+    static std::string lower(std::string s)
+    {
+        for (char &c : s)
+            c = static_cast<char>(tolower(c));
+        return s;
+    }
+
+    // `;` starts a comment unless it sits inside a string literal
+    static std::string strip_comment(const std::string &line)
+    {
+        char quote = 0;
+        for (size_t i = 0; i < line.size(); i++)
+        {
+            if (quote && line.at(i) == quote)
+                quote = 0;
+            else if (!quote && (line.at(i) == '"' || line.at(i) == '\''))
+                quote = line.at(i);
+            else if (!quote && line.at(i) == ';')
+                return trim(line.substr(0, i));
+        }
+        return trim(line);
+    }
+
+    static std::vector<std::string> split_operands(const std::string &s)
+    {
+        std::vector<std::string> out;
+        std::string cur;
+        char quote = 0;
+        for (char c : s)
+        {
+            if (quote && c == quote)
+                quote = 0;
+            else if (!quote && (c == '"' || c == '\''))
+                quote = c;
+            if (!quote && c == ',')
+            {
+                out.push_back(trim(cur));
+                cur.clear();
+                continue;
+            }
+            cur.push_back(c);
+        }
+        if (!trim(cur).empty())
+            out.push_back(trim(cur));
+        return out;
+    }
+
+    static std::optional<int64_t> parse_number(const std::string &s)
+    {
+        if (s.empty())
+            return {};
+        size_t i = 0;
+        bool neg = false;
+        if (s.at(0) == '-' || s.at(0) == '+')
+        {
+            neg = s.at(0) == '-';
+            i = 1;
+        }
+        if (i >= s.size() || !isdigit(s.at(i)))
+            return {};
+        try
+        {
+            // NASM reads `010` as decimal, so only `0x` switches the base
+            const bool hex = s.size() > i + 1 && s.at(i) == '0' && (s.at(i + 1) == 'x' || s.at(i + 1) == 'X');
+            size_t used = 0;
+            const uint64_t v = std::stoull(s.substr(i), &used, hex ? 16 : 10);
+            if (i + used != s.size())
+                return {};
+            return neg ? -static_cast<int64_t>(v) : static_cast<int64_t>(v);
+        }
+        catch (const std::exception &)
+        {
+            return {};
+        }
+    }
+
+    // register number and width, or nothing
+    static std::optional<std::pair<int, int>> parse_reg(const std::string &name)
+    {
+        static const std::unordered_map<std::string, std::pair<int, int>> regs = [] {
+            std::unordered_map<std::string, std::pair<int, int>> m;
+            const char *r64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi"};
+            const char *r32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+            const char *r8[] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil"};
+            for (int i = 0; i < 8; i++)
+            {
+                m[r64[i]] = {i, 64};
+                m[r32[i]] = {i, 32};
+                m[r8[i]] = {i, 8};
+            }
+            for (int i = 8; i < 16; i++)
+            {
+                m["r" + std::to_string(i)] = {i, 64};
+                m["r" + std::to_string(i) + "d"] = {i, 32};
+                m["r" + std::to_string(i) + "b"] = {i, 8};
+            }
+            return m;
+        }();
+        if (regs.contains(name))
+            return regs.at(name);
+        return {};
+    }
+
+    static bool is_label_char(char c)
+    {
+        return isalnum(c) || c == '_' || c == '.' || c == '$';
+    }
+
+    Operand parse_operand(std::string text) const
+    {
+        Operand op{};
+        text = trim(text);
+        const std::string low = lower(text);
+        static const std::pair<std::string, int> sizes[] = {{"qword", 64}, {"dword", 32}, {"word", 16}, {"byte", 8}};
+        for (const auto &[kw, size] : sizes)
+        {
+            if (low.rfind(kw, 0) == 0 && low.size() > kw.size() && !is_label_char(low.at(kw.size())))
+            {
+                op.size = size;
+                text = trim(text.substr(kw.size()));
+                break;
+            }
+        }
+
+        if (!text.empty() && text.front() == '[')
+        {
+            if (text.back() != ']')
+                fail("unterminated memory operand `" + text + "`");
+            op.kind = Operand::Kind::mem;
+            parse_address(text.substr(1, text.size() - 2), op);
+            return op;
+        }
+
+        if (auto reg = parse_reg(lower(text)))
+        {
+            op.kind = Operand::Kind::reg;
+            op.reg = reg->first;
+            op.size = reg->second;
+            return op;
+        }
+
+        // immediate, either a number or `label [+ number]`
+        op.kind = Operand::Kind::imm;
+        parse_address(text, op);
+        if (op.base != -1 || op.index != -1)
+            fail("registers are not allowed in an immediate `" + text + "`");
+        return op;
+    }
+
+    // sums of registers, `reg * scale`, labels and numbers, `rel` is implied
+    void parse_address(const std::string &text, Operand &op) const
+    {
+        std::string term;
+        int sign = 1;
+        auto flush_term = [&](int next_sign) {
+            const std::string t = trim(term);
+            term.clear();
+            if (t.empty())
+            {
+                sign = next_sign;
+                return;
+            }
+            const std::string low = lower(t);
+            if (low == "rel" || low.rfind("rel ", 0) == 0)
+            {
+                if (low != "rel")
+                    add_term(trim(t.substr(3)), sign, op);
+            }
+            else
+            {
+                add_term(t, sign, op);
+            }
+            sign = next_sign;
+        };
+        for (char c : text)
+        {
+            if (c == '+' || c == '-')
+                flush_term(c == '+' ? 1 : -1);
+            else
+                term.push_back(c);
+        }
+        flush_term(1);
+    }
+
+    void add_term(const std::string &t, int sign, Operand &op) const
+    {
+        if (const size_t star = t.find('*'); star != std::string::npos)
+        {
+            auto reg = parse_reg(lower(trim(t.substr(0, star))));
+            auto scale = parse_number(trim(t.substr(star + 1)));
+            if (!reg || !scale || sign < 0 || op.index != -1)
+                fail("bad scaled index `" + t + "`");
+            op.index = reg->first;
+            op.scale = static_cast<int>(scale.value());
+            return;
+        }
+        if (auto reg = parse_reg(lower(t)))
+        {
+            if (sign < 0)
+                fail("cannot subtract a register `" + t + "`");
+            if (op.base == -1)
+                op.base = reg->first;
+            else if (op.index == -1)
+                op.index = reg->first;
+            else
+                fail("too many registers in address");
+            return;
+        }
+        if (auto num = parse_number(t))
+        {
+            op.disp += sign * num.value();
+            return;
+        }
+        if (!op.label.empty() || sign < 0)
+            fail("unsupported label arithmetic `" + t + "`");
+        op.label = t;
+    }
+
+    size_t section(const std::string &name)
+    {
+        for (size_t i = 0; i < m_sections.size(); i++)
+            if (m_sections.at(i).name == name)
+                return i;
+        SectionKind kind = SectionKind::text;
+        if (name.rfind(".rodata", 0) == 0)
+            kind = SectionKind::rodata;
+        else if (name.rfind(".data", 0) == 0)
+            kind = SectionKind::data;
+        else if (name.rfind(".bss", 0) == 0)
+            kind = SectionKind::bss;
+        m_sections.push_back({.name = name, .kind = kind});
+        return m_sections.size() - 1;
+    }
+
+    AsmSection &cur()
+    {
+        return m_sections.at(m_current);
+    }
+
+    void define(const std::string &label)
+    {
+        if (m_symbols.contains(label))
+            fail("label `" + label + "` defined twice");
+        m_symbols[label] = {.section = m_current, .offset = cur().size()};
+    }
+
+    void assemble_line(const std::string &line)
+    {
+        if (line.empty())
+            return;
+
+        // `label:` optionally followed by a directive or instruction
+        size_t i = 0;
+        while (i < line.size() && is_label_char(line.at(i)))
+            i++;
+        if (i > 0 && i < line.size() && line.at(i) == ':')
+        {
+            define(line.substr(0, i));
+            assemble_line(trim(line.substr(i + 1)));
+            return;
+        }
+
+        const size_t space = line.find_first_of(" \t");
+        const std::string mnemonic = lower(line.substr(0, space));
+        const std::string rest = space == std::string::npos ? "" : trim(line.substr(space));
+
+        if (mnemonic == "default" || mnemonic == "global")
+            return;
+        if (mnemonic == "extern")
+        {
+            for (const std::string &name : split_operands(rest))
+                if (m_extern_set.insert(name).second)
+                    m_externs.push_back(name);
+            return;
+        }
+        if (mnemonic == "section")
+        {
+            std::stringstream words(rest);
+            std::string name, attr;
+            words >> name;
+            m_current = section(name);
+            while (words >> attr)
+                if (lower(attr).rfind("align=", 0) == 0)
+                    cur().align = std::max<size_t>(cur().align, std::stoull(attr.substr(6)));
+            return;
+        }
+        if (data_directive(mnemonic, rest))
+            return;
+
+        if (cur().kind != SectionKind::text)
+            fail("instruction outside of .text `" + line + "`");
+
+        std::string m = mnemonic;
+        std::string operands = rest;
+        if (m == "lock")
+        {
+            m_bytes.push_back(0xF0);
+            const size_t sp = rest.find_first_of(" \t");
+            m = lower(rest.substr(0, sp));
+            operands = sp == std::string::npos ? "" : trim(rest.substr(sp));
+        }
+        std::vector<Operand> ops;
+        for (const std::string &text : split_operands(operands))
+            ops.push_back(parse_operand(text));
+        instruction(m, ops, line);
+        cur().bytes.insert(cur().bytes.end(), m_bytes.begin(), m_bytes.end());
+        for (AsmFixup &fixup : m_pending)
+        {
+            fixup.section = m_current;
+            fixup.offset += cur().bytes.size() - m_bytes.size();
+            fixup.next_ip += cur().bytes.size() - m_bytes.size();
+            m_fixups.push_back(fixup);
+        }
+        m_bytes.clear();
+        m_pending.clear();
+    }
+
+    bool data_directive(const std::string &mnemonic, const std::string &rest)
+    {
+        AsmSection &s = cur();
+        if (mnemonic == "resb" || mnemonic == "resq")
+        {
+            auto count = parse_number(rest);
+            if (!count || s.kind != SectionKind::bss)
+                fail("`" + mnemonic + "` needs a count and a .bss section");
+            s.bss_size += count.value() * (mnemonic == "resq" ? 8 : 1);
+            return true;
+        }
+        if (mnemonic == "align" || mnemonic == "alignb")
+        {
+            auto boundary = parse_number(rest);
+            if (!boundary || boundary.value() <= 0)
+                fail("bad alignment `" + rest + "`");
+            const size_t n = boundary.value();
+            s.align = std::max(s.align, n);
+            while (s.size() % n != 0)
+            {
+                if (s.kind == SectionKind::bss)
+                    s.bss_size++;
+                else
+                    // nop in code, zero in data
+                    s.bytes.push_back(s.kind == SectionKind::text ? 0x90 : 0x00);
+            }
+            return true;
+        }
+        if (mnemonic == "db" || mnemonic == "dq")
+        {
+            if (s.kind == SectionKind::bss)
+                fail("initialized data in .bss");
+            for (const std::string &item : split_operands(rest))
+            {
+                if (mnemonic == "db" && item.size() >= 2 && (item.front() == '"' || item.front() == '\''))
+                {
+                    for (size_t i = 1; i + 1 < item.size(); i++)
+                        s.bytes.push_back(static_cast<uint8_t>(item.at(i)));
+                    continue;
+                }
+                if (auto num = parse_number(item))
+                {
+                    const size_t width = mnemonic == "db" ? 1 : 8;
+                    for (size_t b = 0; b < width; b++)
+                        s.bytes.push_back(static_cast<uint8_t>(static_cast<uint64_t>(num.value()) >> (8 * b)));
+                    continue;
+                }
+                if (mnemonic == "db")
+                    fail("bad byte `" + item + "`");
+                m_fixups.push_back({.kind = AsmFixup::Kind::abs64, .section = m_current,
+                                    .offset = s.bytes.size(), .next_ip = 0, .symbol = item});
+                s.bytes.insert(s.bytes.end(), 8, 0);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // ---- encoding ----
+
+    void emit(std::initializer_list<uint8_t> bytes)
+    {
+        m_bytes.insert(m_bytes.end(), bytes);
+    }
+
+    void emit_imm(int64_t v, size_t width)
+    {
+        for (size_t b = 0; b < width; b++)
+            m_bytes.push_back(static_cast<uint8_t>(static_cast<uint64_t>(v) >> (8 * b)));
+    }
+
+    static bool fits8(int64_t v) { return v >= INT8_MIN && v <= INT8_MAX; }
+    static bool fits32(int64_t v) { return v >= INT32_MIN && v <= INT32_MAX; }
+
+    // REX, opcode, ModRM (+SIB, +disp) for `reg` against the r/m operand.
+    // `imm_bytes` is how many immediate bytes the caller appends afterwards,
+    // needed so rip-relative displacements are relative to the real next ip
+    void emit_modrm(std::initializer_list<uint8_t> opcode, int reg, const Operand &rm, bool w, size_t imm_bytes = 0,
+                    bool byte_regs = false)
+    {
+        uint8_t rex = w ? 0x48 : 0x00;
+        if (reg >= 8)
+            rex |= 0x44;
+        if (rm.kind == Operand::Kind::reg)
+        {
+            if (rm.reg >= 8)
+                rex |= 0x41;
+            // spl/bpl/sil/dil only exist with a REX prefix
+            if (byte_regs && (rm.reg >= 4 || reg >= 4))
+                rex |= 0x40;
+            if (rex)
+                m_bytes.push_back(rex);
+            m_bytes.insert(m_bytes.end(), opcode);
+            m_bytes.push_back(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm.reg & 7)));
+            return;
+        }
+
+        if (rm.kind != Operand::Kind::mem)
+            fail("expected a register or memory operand");
+        if (rm.base >= 8)
+            rex |= 0x41;
+        if (rm.index >= 8)
+            rex |= 0x42;
+        if (byte_regs && reg >= 4)
+            rex |= 0x40;
+        if (rex)
+            m_bytes.push_back(rex);
+        m_bytes.insert(m_bytes.end(), opcode);
+
+        if (!rm.label.empty())
+        {
+            if (rm.base != -1 || rm.index != -1)
+                fail("labels cannot be combined with registers in the JIT, use lea first");
+            // rip-relative, mod 00 rm 101
+            m_bytes.push_back(static_cast<uint8_t>(((reg & 7) << 3) | 0x05));
+            m_pending.push_back({.kind = AsmFixup::Kind::rel32, .offset = m_bytes.size(),
+                                 .next_ip = m_bytes.size() + 4 + imm_bytes, .symbol = rm.label,
+                                 .addend = rm.disp});
+            emit_imm(0, 4);
+            return;
+        }
+
+        if (!fits32(rm.disp))
+            fail("displacement out of range");
+        if (rm.index == 4)
+            fail("rsp cannot be an index register");
+        uint8_t scale_bits = 0;
+        switch (rm.scale)
+        {
+            case 1: scale_bits = 0; break;
+            case 2: scale_bits = 1; break;
+            case 4: scale_bits = 2; break;
+            case 8: scale_bits = 3; break;
+            default: fail("scale must be 1, 2, 4 or 8");
+        }
+
+        if (rm.base == -1)
+        {
+            // absolute disp32 through a SIB byte with no base
+            m_bytes.push_back(static_cast<uint8_t>(((reg & 7) << 3) | 0x04));
+            const int index = rm.index == -1 ? 4 : rm.index;
+            m_bytes.push_back(static_cast<uint8_t>((scale_bits << 6) | ((index & 7) << 3) | 0x05));
+            emit_imm(rm.disp, 4);
+            return;
+        }
+
+        uint8_t mod;
+        // rbp and r13 as a base always need a displacement
+        if (rm.disp == 0 && (rm.base & 7) != 5)
+            mod = 0x00;
+        else if (fits8(rm.disp))
+            mod = 0x40;
+        else
+            mod = 0x80;
+
+        if (rm.index != -1 || (rm.base & 7) == 4)
+        {
+            const int index = rm.index == -1 ? 4 : rm.index;
+            m_bytes.push_back(static_cast<uint8_t>(mod | ((reg & 7) << 3) | 0x04));
+            m_bytes.push_back(static_cast<uint8_t>((scale_bits << 6) | ((index & 7) << 3) | (rm.base & 7)));
+        }
+        else
+        {
+            m_bytes.push_back(static_cast<uint8_t>(mod | ((reg & 7) << 3) | (rm.base & 7)));
+        }
+        if (mod == 0x40)
+            emit_imm(rm.disp, 1);
+        else if (mod == 0x80)
+            emit_imm(rm.disp, 4);
+    }
+
+    void emit_rel32(const std::string &label)
+    {
+        m_pending.push_back({.kind = AsmFixup::Kind::rel32, .offset = m_bytes.size(),
+                             .next_ip = m_bytes.size() + 4, .symbol = label});
+        emit_imm(0, 4);
+    }
+
+    static int op_size(const Operand &op)
+    {
+        return op.size == 0 ? 64 : op.size;
+    }
+
+    void expect(const std::vector<Operand> &ops, size_t n, const std::string &line) const
+    {
+        if (ops.size() != n)
+            fail("wrong number of operands in `" + line + "`");
+    }
+
+    void instruction(const std::string &m, const std::vector<Operand> &ops, const std::string &line)
+    {
+        using K = Operand::Kind;
+
+        // no-operand instructions
+        static const std::unordered_map<std::string, std::vector<uint8_t>> plain = {
+            {"ret", {0xC3}}, {"leave", {0xC9}}, {"syscall", {0x0F, 0x05}}, {"nop", {0x90}},
+            {"pause", {0xF3, 0x90}}, {"cqo", {0x48, 0x99}}, {"mfence", {0x0F, 0xAE, 0xF0}},
+            {"int3", {0xCC}}, {"lfence", {0x0F, 0xAE, 0xE8}}, {"rdtscp", {0x0F, 0x01, 0xF9}},
+        };
+        if (plain.contains(m))
+        {
+            expect(ops, 0, line);
+            m_bytes.insert(m_bytes.end(), plain.at(m).begin(), plain.at(m).end());
+            return;
+        }
+
+        // classic two-operand ALU group, the /digit doubles as the opcode row
+        static const std::unordered_map<std::string, uint8_t> alu = {
+            {"add", 0}, {"or", 1}, {"adc", 2}, {"sbb", 3}, {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7},
+        };
+        if (alu.contains(m))
+        {
+            expect(ops, 2, line);
+            const uint8_t row = alu.at(m);
+            const Operand &dst = ops.at(0);
+            const Operand &src = ops.at(1);
+            const bool w = op_size(dst.kind == K::reg ? dst : src) == 64;
+            if (src.kind == K::imm)
+            {
+                if (!src.label.empty() || !fits32(src.disp))
+                    fail("immediate out of range in `" + line + "`");
+                if (fits8(src.disp))
+                {
+                    emit_modrm({0x83}, row, dst, w, 1);
+                    emit_imm(src.disp, 1);
+                }
+                else
+                {
+                    emit_modrm({0x81}, row, dst, w, 4);
+                    emit_imm(src.disp, 4);
+                }
+            }
+            else if (src.kind == K::reg)
+                emit_modrm({static_cast<uint8_t>(row * 8 + 1)}, src.reg, dst, w);
+            else if (dst.kind == K::reg)
+                emit_modrm({static_cast<uint8_t>(row * 8 + 3)}, dst.reg, src, w);
+            else
+                fail("unsupported operands in `" + line + "`");
+            return;
+        }
+
+        if (m == "mov")
+        {
+            expect(ops, 2, line);
+            const Operand &dst = ops.at(0);
+            const Operand &src = ops.at(1);
+            if (dst.kind == K::reg && src.kind == K::imm)
+            {
+                if (!src.label.empty())
+                {
+                    // label address as a 64-bit immediate
+                    if (dst.reg >= 8)
+                        emit({0x49});
+                    else
+                        emit({0x48});
+                    emit({static_cast<uint8_t>(0xB8 + (dst.reg & 7))});
+                    m_pending.push_back({.kind = AsmFixup::Kind::abs64, .offset = m_bytes.size(),
+                                         .symbol = src.label, .addend = src.disp});
+                    emit_imm(0, 8);
+                }
+                else if (dst.size == 32 || (dst.size == 64 && src.disp >= 0 && src.disp <= UINT32_MAX))
+                {
+                    // mov r32, imm32 zero-extends into the full register
+                    if (dst.reg >= 8)
+                        emit({0x41});
+                    emit({static_cast<uint8_t>(0xB8 + (dst.reg & 7))});
+                    emit_imm(src.disp, 4);
+                }
+                else if (fits32(src.disp))
+                {
+                    emit_modrm({0xC7}, 0, dst, true, 4);
+                    emit_imm(src.disp, 4);
+                }
+                else
+                {
+                    emit({static_cast<uint8_t>(dst.reg >= 8 ? 0x49 : 0x48), static_cast<uint8_t>(0xB8 + (dst.reg & 7))});
+                    emit_imm(src.disp, 8);
+                }
+            }
+            else if (dst.kind == K::mem && src.kind == K::imm)
+            {
+                if (!src.label.empty() || !fits32(src.disp))
+                    fail("immediate out of range in `" + line + "`");
+                if (op_size(dst) == 8)
+                {
+                    emit_modrm({0xC6}, 0, dst, false, 1);
+                    emit_imm(src.disp, 1);
+                }
+                else
+                {
+                    emit_modrm({0xC7}, 0, dst, op_size(dst) == 64, 4);
+                    emit_imm(src.disp, 4);
+                }
+            }
+            else if (src.kind == K::reg && src.size == 8)
+                emit_modrm({0x88}, src.reg, dst, false, 0, true);
+            else if (dst.kind == K::reg && dst.size == 8)
+                emit_modrm({0x8A}, dst.reg, src, false, 0, true);
+            else if (src.kind == K::reg)
+                emit_modrm({0x89}, src.reg, dst, src.size == 64);
+            else if (dst.kind == K::reg)
+                emit_modrm({0x8B}, dst.reg, src, dst.size == 64);
+            else
+                fail("unsupported operands in `" + line + "`");
+            return;
+        }
+
+        if (m == "movzx")
+        {
+            expect(ops, 2, line);
+            if (ops.at(0).kind != K::reg || op_size(ops.at(1)) != 8)
+                fail("movzx only supports `reg, byte r/m`");
+            emit_modrm({0x0F, 0xB6}, ops.at(0).reg, ops.at(1), ops.at(0).size == 64, 0, true);
+            return;
+        }
+
+        if (m == "lea")
+        {
+            expect(ops, 2, line);
+            if (ops.at(0).kind != K::reg || ops.at(1).kind != K::mem)
+                fail("lea needs a register and a memory operand");
+            emit_modrm({0x8D}, ops.at(0).reg, ops.at(1), true);
+            return;
+        }
+
+        if (m == "test")
+        {
+            expect(ops, 2, line);
+            if (ops.at(1).kind != K::reg)
+                fail("test only supports `r/m, reg`");
+            emit_modrm({0x85}, ops.at(1).reg, ops.at(0), ops.at(1).size == 64);
+            return;
+        }
+
+        if (m == "imul")
+        {
+            expect(ops, 2, line);
+            if (ops.at(0).kind != K::reg)
+                fail("imul only supports `reg, r/m`");
+            emit_modrm({0x0F, 0xAF}, ops.at(0).reg, ops.at(1), true);
+            return;
+        }
+
+        // read-modify-write `r/m, reg`, atomic with a lock prefix (xchg always is)
+        static const std::unordered_map<std::string, uint8_t> rmw = {{"xadd", 0xC1}, {"cmpxchg", 0xB1}, {"xchg", 0x87}};
+        if (rmw.contains(m))
+        {
+            expect(ops, 2, line);
+            const bool swapped = m == "xchg" && ops.at(0).kind == K::reg && ops.at(1).kind == K::mem;
+            const Operand &dst = swapped ? ops.at(1) : ops.at(0);
+            const Operand &src = swapped ? ops.at(0) : ops.at(1);
+            if (src.kind != K::reg || src.size != 64)
+                fail(m + " only supports `r/m64, reg64`");
+            if (m == "xchg")
+                emit_modrm({0x87}, src.reg, dst, true);
+            else
+                emit_modrm({0x0F, rmw.at(m)}, src.reg, dst, true);
+            return;
+        }
+
+        static const std::unordered_map<std::string, uint8_t> setcc = {{"sete", 0x94}, {"setne", 0x95}};
+        if (setcc.contains(m))
+        {
+            expect(ops, 1, line);
+            if (op_size(ops.at(0)) != 8)
+                fail(m + " only supports a byte r/m");
+            emit_modrm({0x0F, setcc.at(m)}, 0, ops.at(0), false, 0, true);
+            return;
+        }
+
+        // single r/m operand group under 0xF7 / 0xFF
+        static const std::unordered_map<std::string, std::pair<uint8_t, uint8_t>> unary = {
+            {"not", {0xF7, 2}}, {"neg", {0xF7, 3}}, {"mul", {0xF7, 4}}, {"div", {0xF7, 6}}, {"idiv", {0xF7, 7}},
+            {"inc", {0xFF, 0}}, {"dec", {0xFF, 1}},
+        };
+        if (unary.contains(m))
+        {
+            expect(ops, 1, line);
+            emit_modrm({unary.at(m).first}, unary.at(m).second, ops.at(0), op_size(ops.at(0)) == 64);
+            return;
+        }
+
+        static const std::unordered_map<std::string, uint8_t> shifts = {{"shl", 4}, {"shr", 5}, {"sar", 7}};
+        if (shifts.contains(m))
+        {
+            expect(ops, 2, line);
+            // count in cl
+            if (ops.at(1).kind == K::reg && ops.at(1).size == 8 && ops.at(1).reg == 1)
+            {
+                emit_modrm({0xD3}, shifts.at(m), ops.at(0), op_size(ops.at(0)) == 64);
+                return;
+            }
+            if (ops.at(1).kind != K::imm || !ops.at(1).label.empty())
+                fail("shifts only take an immediate count or cl");
+            emit_modrm({0xC1}, shifts.at(m), ops.at(0), op_size(ops.at(0)) == 64, 1);
+            emit_imm(ops.at(1).disp, 1);
+            return;
+        }
+
+        if (m == "push")
+        {
+            expect(ops, 1, line);
+            const Operand &op = ops.at(0);
+            if (op.kind == K::reg)
+            {
+                if (op.reg >= 8)
+                    emit({0x41});
+                emit({static_cast<uint8_t>(0x50 + (op.reg & 7))});
+            }
+            else if (op.kind == K::mem)
+                emit_modrm({0xFF}, 6, op, false);
+            else
+            {
+                if (!op.label.empty() || !fits32(op.disp))
+                    fail("immediate out of range in `" + line + "`");
+                emit({0x68});
+                emit_imm(op.disp, 4);
+            }
+            return;
+        }
+
+        if (m == "pop")
+        {
+            expect(ops, 1, line);
+            const Operand &op = ops.at(0);
+            if (op.kind == K::reg)
+            {
+                if (op.reg >= 8)
+                    emit({0x41});
+                emit({static_cast<uint8_t>(0x58 + (op.reg & 7))});
+            }
+            else
+                emit_modrm({0x8F}, 0, op, false);
+            return;
+        }
+
+        if (m == "call" || m == "jmp")
+        {
+            expect(ops, 1, line);
+            const Operand &op = ops.at(0);
+            const uint8_t digit = m == "call" ? 2 : 4;
+            if (op.kind == K::imm && !op.label.empty() && op.disp == 0)
+            {
+                if (m_extern_set.contains(op.label))
+                {
+                    // through the extern's address slot, it may live anywhere in memory
+                    emit({0xFF, static_cast<uint8_t>((digit << 3) | 0x05)});
+                    m_pending.push_back({.kind = AsmFixup::Kind::rel32, .offset = m_bytes.size(),
+                                         .next_ip = m_bytes.size() + 4, .symbol = op.label, .via_slot = true});
+                    emit_imm(0, 4);
+                }
+                else
+                {
+                    emit({static_cast<uint8_t>(m == "call" ? 0xE8 : 0xE9)});
+                    emit_rel32(op.label);
+                }
+            }
+            else if (op.kind != K::imm)
+                emit_modrm({0xFF}, digit, op, false);
+            else
+                fail("unsupported branch target in `" + line + "`");
+            return;
+        }
+
+        static const std::unordered_map<std::string, uint8_t> conditions = {
+            {"jo", 0}, {"jno", 1}, {"jb", 2}, {"jc", 2}, {"jae", 3}, {"jnc", 3}, {"je", 4}, {"jz", 4},
+            {"jne", 5}, {"jnz", 5}, {"jbe", 6}, {"ja", 7}, {"js", 8}, {"jns", 9}, {"jl", 12}, {"jge", 13},
+            {"jle", 14}, {"jg", 15},
+        };
+        if (conditions.contains(m))
+        {
+            expect(ops, 1, line);
+            if (ops.at(0).kind != K::imm || ops.at(0).label.empty())
+                fail("conditional jumps need a label");
+            emit({0x0F, static_cast<uint8_t>(0x80 + conditions.at(m))});
+            emit_rel32(ops.at(0).label);
+            return;
+        }
+
+        fail("unsupported instruction `" + line + "`");
+    }
+
+    const std::string m_src;
+    size_t m_line = 0;
+    size_t m_current = 0;
+    std::vector<AsmSection> m_sections;
+    std::unordered_map<std::string, AsmSymbol> m_symbols;
+    std::vector<AsmFixup> m_fixups;
+    std::vector<std::string> m_externs;
+    std::unordered_set<std::string> m_extern_set;
+    // the instruction being encoded and its fixups, offsets relative to its first byte
+    std::vector<uint8_t> m_bytes;
+    std::vector<AsmFixup> m_pending;
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./jit.hpp"
+#include "./toolchain.hpp"
+#include "./tsc.hpp"
+
+struct ContentionConfig
+{
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    // operations per thread
+    size_t ops = 1000000;
+};
+
+// how hard a primitive gets hammered by more and more threads. every case is a
+// `.hy` program, one worker per thread looping `repeat (ops)` over a single
+// operation, compiled through the JIT. each worker reads rdtscp() right before
+// and after its loop, and the window runs from the first thread starting to the
+// last one finishing, so spawning and joining threads is not counted. `shared`
+// puts every thread on the same global, `padded` gives each thread its own
+// element 64 bytes apart so only the cost of the instruction itself is left
+class ContentionBench
+{
+public:
+    enum class Primitive {store, atomic_add, swap, cas};
+
+    explicit ContentionBench(ContentionConfig config)
+        : m_config(config) {}
+
+    // returns the number of cases whose final counter didn't add up
+    size_t run()
+    {
+        using namespace std;
+        cout << left << setw(12) << "primitive" << setw(8) << "layout" << right << setw(8) << "threads"
+             << setw(14) << "Mops/s" << setw(18) << "Mops/s/thread" << setw(10) << "cas ok" << "\n";
+
+        size_t bad = 0;
+        for (Primitive primitive : {Primitive::store, Primitive::atomic_add, Primitive::swap, Primitive::cas})
+            for (bool padded : {false, true})
+                for (size_t threads : thread_counts())
+                    bad += run_case(primitive, padded, threads) ? 0 : 1;
+        cout.flush();
+        return bad;
+    }
+
+    static std::string emit(Primitive primitive, bool padded, size_t threads, size_t ops)
+    {
+        std::stringstream src;
+        if (padded)
+            src << "global let c[" << threads * slot_stride << "] = 0;\n";
+        else
+            src << "global let c = 0;\n";
+        src << "global let t0[" << threads << "] = 0;\n";
+        src << "global let t1[" << threads << "] = 0;\n";
+        for (size_t t = 0; t < threads; t++)
+        {
+            const std::string target = padded ? "c[" + std::to_string(t * slot_stride) + "]" : "c";
+            src << "|| worker_" << t << "\n";
+            src << "t0[" << t << "] = rdtscp();\n";
+            src << "repeat (" << ops << ") {\n";
+            switch (primitive)
+            {
+                case Primitive::store:
+                    src << "    " << target << " = 1;\n";
+                    break;
+                case Primitive::atomic_add:
+                    src << "    " << target << " += 1 atomic;\n";
+                    break;
+                case Primitive::swap:
+                    src << "    swap(" << target << ", 1);\n";
+                    break;
+                case Primitive::cas:
+                    // a cas increment, each success bumps the counter by one
+                    src << "    let old = " << target << ";\n";
+                    src << "    cas(" << target << ", old, old + 1);\n";
+                    break;
+            }
+            src << "}\n";
+            src << "t1[" << t << "] = rdtscp();\n";
+            src << "||\n";
+        }
+        src << "start_workers();\n";
+        return src.str();
+    }
+
+private:
+    // qwords between two threads' counters, one cache line
+    static constexpr size_t slot_stride = 8;
+
+    [[nodiscard]] std::vector<size_t> thread_counts() const
+    {
+        std::vector<size_t> counts;
+        for (size_t n = 1; n < m_config.max_threads; n *= 2)
+            counts.push_back(n);
+        counts.push_back(m_config.max_threads);
+        return counts;
+    }
+
+    static const char *name(Primitive primitive)
+    {
+        switch (primitive)
+        {
+            case Primitive::store: return "store";
+            case Primitive::atomic_add: return "atomic_add";
+            case Primitive::swap: return "swap";
+            case Primitive::cas: return "cas";
+        }
+        return "";
+    }
+
+    bool run_case(Primitive primitive, bool padded, size_t threads) const
+    {
+        using namespace std;
+        // every worker and loop on its own line, so runs differ only in the data layout
+        const CodeLayout layout{.worker_align = 64, .loop_align = 64};
+        JitImage image(compile_to_asm(emit(primitive, padded, threads, m_config.ops), ReportFormat::text, nullptr, layout));
+
+        image.run();
+        const auto *starts = static_cast<const uint64_t*>(image.symbol("t0"));
+        const auto *ends = static_cast<const uint64_t*>(image.symbol("t1"));
+        const uint64_t first = *min_element(starts, starts + threads);
+        const uint64_t last = *max_element(ends, ends + threads);
+        const double secs = static_cast<double>(last - first) / tsc_ghz() / 1e9;
+
+        const auto *counters = static_cast<const int64_t*>(image.symbol("c"));
+        int64_t total = 0;
+        for (size_t t = 0; t < (padded ? threads : 1); t++)
+            total += counters[t * slot_stride];
+
+        const double ops = static_cast<double>(threads * m_config.ops);
+        const double mops = secs > 0 ? ops / secs / 1e6 : 0.0;
+        cout << left << setw(12) << name(primitive) << setw(8) << (padded ? "padded" : "shared")
+             << right << setw(8) << threads << fixed << setprecision(2) << setw(14) << mops
+             << setw(18) << mops / static_cast<double>(threads);
+        if (primitive == Primitive::cas)
+            cout << setw(9) << setprecision(1) << 100.0 * static_cast<double>(total) / ops << "%";
+        cout << defaultfloat << setprecision(6) << "\n";
+
+        // only the atomics promise an exact count
+        bool ok = true;
+        if (primitive == Primitive::atomic_add)
+            ok = total == static_cast<int64_t>(ops);
+        else if (primitive == Primitive::cas && padded)
+            ok = total == static_cast<int64_t>(ops);
+        if (!ok)
+            cout << "  counter ended at " << total << ", expected " << static_cast<int64_t>(ops) << "\n";
+        return ok;
+    }
+
+    ContentionConfig m_config;
+};
@@ -1,14 +1,37 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <unordered_map>
 #include <unordered_set>
 #include "parser.hpp"
 
+// how report/print values are written out
+enum class ReportFormat {text, csv, json};
+
+// where code for workers and their loops is placed
+struct CodeLayout
+{
+    // byte boundary for every worker entry point and repeat loop head, 0 packs them
+    size_t worker_align = 0;
+    size_t loop_align = 0;
+    // each worker in a page aligned section of its own
+    bool worker_sections = false;
+    // text laid out on 2 MiB boundaries so it can sit on huge pages, this is
+    // down to the linker flags and the JIT's mapping, the assembly is the same
+    bool huge_pages = false;
+};
+
 class Generator
 {
   public:
-     Generator(NodeProg prog)
-      : m_prog(std::move(prog)){}
+     Generator(NodeProg prog, ReportFormat format = ReportFormat::text, CodeLayout layout = {})
+      : m_prog(std::move(prog)), m_format(format), m_layout(layout)
+     {
+       for (const NodeStmt *stmt : m_prog.stmts)
+         if (std::holds_alternative<NodeStmtReport*>(stmt->var))
+           m_has_reports = true;
+     }
 
     void gen_term(const NodeTerm *term)
      {
@@ -25,25 +48,95 @@ class Generator
 
          void operator()(const NodeTermIdent *term_ident) const
          {
-           //check if the identifier exists
            std::string name = term_ident->ident.value.value();
+           // worker locals live in a register or the worker's frame, no memory traffic
+           if (gen->m_vars.contains(name))
+           {
+             gen->push(gen->m_vars.at(name).loc);
+             return;
+           }
+           //check if the identifier exists
            if (!gen->m_globals.contains(name))
            {
              std::cerr << "Undeclared Global Identifier:  " << term_ident->ident.value.value() << std::endl;
              exit(EXIT_FAILURE);
            }
+           if (gen->m_globals.at(name) != 0)
+           {
+             std::cerr << "Global array used without an index: " << name << std::endl;
+             exit(EXIT_FAILURE);
+           }
            std::stringstream addr;
            addr << "QWORD [rel " << name << "]";
            gen->push(addr.str());
-           // if (!gen->m_vars.contains(term_ident->ident.value.value()))
-           // {
-           //   std::cerr << "Undeclared Identifier:  " << term_ident->ident.value.value() << std::endl;
-           //   exit(EXIT_FAILURE);
-           // }
-           // const auto &var = gen->m_vars.at(term_ident->ident.value.value());
-           // std::stringstream offset;
-           // offset << "QWORD [rsp + " << (gen->m_stack_size - var.stack_loc - 1) * 8 << "]";
-           // gen->push(offset.str());
+         }
+
+         void operator()(const NodeTermIndex *term_index) const
+         {
+           gen->gen_element_addr(term_index->ident, term_index->index);
+           gen->push("QWORD [rdx + rcx*8]");
+         }
+
+         // cycles since reset. rdtscp waits for earlier instructions but lets
+         // later ones start before it reads the counter, the lfence holds them
+         void operator()(const NodeTermRdtscp *) const
+         {
+           gen->m_output << "    rdtscp\n";
+           gen->m_output << "    lfence\n";
+           gen->m_output << "    shl rdx, 32\n";
+           gen->m_output << "    or rax, rdx\n";
+           gen->push("rax");
+         }
+
+         void operator()(const NodeTermTid *) const
+         {
+           if (!gen->in_worker)
+           {
+             std::cerr << "tid used outside a worker\n";
+             exit(EXIT_FAILURE);
+           }
+           // the worker's prologue parks its thread index in the frame
+           gen->push("QWORD [rbp - 8]");
+         }
+
+         // operands go left to right (index, expected, value) like every other
+         // expression, then one locked instruction does the whole read-modify-write.
+         // locked instructions drain the store buffer, so each is also a full fence
+         void operator()(const NodeTermRmw *term_rmw) const
+         {
+           gen->check_shared_target(term_rmw->ident, term_rmw->index);
+           if (term_rmw->index)
+             gen->gen_expr(term_rmw->index);
+           if (term_rmw->expected)
+             gen->gen_expr(term_rmw->expected);
+           gen->gen_expr(term_rmw->value);
+           gen->pop("r8");
+           if (term_rmw->expected)
+             gen->pop("rax");
+           std::string target = "[rel " + term_rmw->ident.value.value() + "]";
+           if (term_rmw->index)
+           {
+             gen->gen_element_addr(term_rmw->ident, term_rmw->index, false);
+             target = "[rdx + rcx*8]";
+           }
+           switch (term_rmw->op)
+           {
+             case RmwOp::add:
+               gen->m_output << "    lock xadd QWORD " << target << ", r8\n";
+               gen->push("r8");
+               break;
+             case RmwOp::swap:
+               // xchg with memory is locked without the prefix
+               gen->m_output << "    xchg QWORD " << target << ", r8\n";
+               gen->push("r8");
+               break;
+             case RmwOp::cas:
+               gen->m_output << "    lock cmpxchg QWORD " << target << ", r8\n";
+               gen->m_output << "    sete al\n";
+               gen->m_output << "    movzx eax, al\n";
+               gen->push("rax");
+               break;
+           }
          }
        };
 
@@ -68,9 +161,10 @@ class Generator
           // push left and right handside on stack for register summation
           gen->gen_expr(bin_expr->add->lhs);
           gen->gen_expr(bin_expr->add->rhs);
+          // rcx, not rbx: rbx is callee-saved and may hold a worker local
           gen->pop("rax");
-          gen->pop("rbx");
-          gen->m_output << "    add rax, rbx\n";
+          gen->pop("rcx");
+          gen->m_output << "    add rax, rcx\n";
           gen->push("rax");
         }
       };
@@ -90,6 +184,9 @@ class Generator
         {
           gen->m_output << ";NodeExit\n";
           gen->gen_expr(stmt_exit->expr);
+          // results are still sitting in the report buffer
+          if (gen->m_has_reports && !gen->in_worker)
+            gen->m_output << "    call hy_flush\n";
           gen->m_output << "    mov rax, 60\n";
           // popping expression evaluated from the stack
           gen->pop("rdi");
@@ -98,17 +195,30 @@ class Generator
 
         void operator()(const NodeStmtLet *stmt_let) const
         {
-          ;
-          // //check if a var is not already declared
-          // if (gen->m_vars.contains(stmt_let->ident.value.value()))
-          // {
-          //   std::cerr << "Identifier already used " << stmt_let->ident.value.value() << std::endl;
-          //   exit(EXIT_FAILURE);
-          // }
-          // // evaluate expression for variable assignment
-          // gen->m_vars.insert({stmt_let->ident.value.value(), Var {.stack_loc = gen->m_stack_size}});
-          // // this pops on the stack for local declaration
-          // gen->gen_expr(stmt_let->expr);
+          const std::string &name = stmt_let->ident.value.value();
+          if (!gen->in_worker)
+          {
+            std::cerr << "Local let outside a worker, use global let: " << name << std::endl;
+            exit(EXIT_FAILURE);
+          }
+          //check if a var is not already declared
+          if (gen->m_vars.contains(name))
+          {
+            std::cerr << "Identifier already used " << name << std::endl;
+            exit(EXIT_FAILURE);
+          }
+          if (gen->m_globals.contains(name))
+          {
+            std::cerr << "Local shadows global variable: " << name << std::endl;
+            exit(EXIT_FAILURE);
+          }
+          // the initializer can't see the variable it declares
+          gen->gen_expr(stmt_let->expr);
+          gen->pop("rax");
+          const Var var {.loc = gen->local_loc(gen->m_scope_vars.size())};
+          gen->m_vars.insert({name, var});
+          gen->m_scope_vars.push_back(name);
+          gen->m_output << "    mov " << var.loc << ", rax\n";
         }
 
         void operator()(const NodeGlobalStmtLet *global_let) const
@@ -123,12 +233,98 @@ class Generator
             std::cerr << "Duplicate global variable: " << name << "\n";
             std::exit(EXIT_FAILURE);
           }
-          // add globals to .bss
-          gen->m_globals.insert(name);
-          gen->m_output << "    " << name << ": resq 1\n";
+          // add globals to .bss, arrays get one qword per element and start on
+          // a fresh cache line so `slot[8]` style padding really is one line
+          gen->m_globals.insert({name, global_let->length});
+          if (global_let->length != 0)
+            gen->m_output << "    alignb " << cache_line << "\n";
+          gen->m_output << "    " << name << ": resq " << std::max<size_t>(global_let->length, 1) << "\n";
         }
 
-        void operator()(const NodeStmtStart *stmt_start) const
+        void operator()(const NodeStmtRmw *stmt_rmw) const
+        {
+          gen->gen_expr(stmt_rmw->expr);
+          // only the side effect matters
+          gen->pop("rax");
+        }
+
+        // sched_setaffinity(0, 128, mask) with a 1024 bit mask built on the
+        // stack, CPUs past that are ignored like the kernel would reject them
+        void operator()(const NodeStmtPin *stmt_pin) const
+        {
+          const std::string skip = gen->new_label("pin_skip");
+          gen->gen_expr(stmt_pin->cpu);
+          gen->pop("rax");
+          gen->m_output << "    cmp rax, " << cpu_mask_bytes * 8 << "\n";
+          gen->m_output << "    jae " << skip << "\n";
+          gen->m_output << "    sub rsp, " << cpu_mask_bytes << "\n";
+          for (size_t i = 0; i < cpu_mask_bytes; i += 8)
+            gen->m_output << "    mov QWORD [rsp + " << i << "], 0\n";
+          gen->m_output << "    mov rcx, rax\n";
+          gen->m_output << "    and rcx, 63\n";
+          gen->m_output << "    shr rax, 6\n";
+          gen->m_output << "    mov rdx, 1\n";
+          gen->m_output << "    shl rdx, cl\n";
+          gen->m_output << "    mov [rsp + rax*8], rdx\n";
+          gen->m_output << "    mov rax, 203\n";
+          gen->m_output << "    xor rdi, rdi\n";
+          gen->m_output << "    mov rsi, " << cpu_mask_bytes << "\n";
+          gen->m_output << "    mov rdx, rsp\n";
+          gen->m_output << "    syscall\n";
+          gen->m_output << "    add rsp, " << cpu_mask_bytes << "\n";
+          gen->m_output << skip << ":\n";
+        }
+
+        // value first, then spin on plain loads until the global matches it
+        void operator()(const NodeStmtAwait *stmt_await) const
+        {
+          gen->check_shared_target(stmt_await->ident, stmt_await->index);
+          if (stmt_await->index)
+            gen->gen_expr(stmt_await->index);
+          gen->gen_expr(stmt_await->value);
+          gen->pop("r8");
+          std::string target = "[rel " + stmt_await->ident.value.value() + "]";
+          if (stmt_await->index)
+          {
+            gen->gen_element_addr(stmt_await->ident, stmt_await->index, false);
+            target = "[rdx + rcx*8]";
+          }
+          const std::string spin = gen->new_label("await");
+          const std::string done = gen->new_label("await_done");
+          gen->m_output << spin << ":\n";
+          gen->m_output << "    cmp QWORD " << target << ", r8\n";
+          gen->m_output << "    je " << done << "\n";
+          gen->m_output << "    pause\n";
+          gen->m_output << "    jmp " << spin << "\n";
+          gen->m_output << done << ":\n";
+        }
+
+        void operator()(const NodeStmtRepeat *stmt_repeat) const
+        {
+          if (!gen->in_worker)
+          {
+            std::cerr << "repeat outside a worker not allowed\n";
+            std::exit(EXIT_FAILURE);
+          }
+          // the trip count lives in the worker's frame, locals declared in
+          // the body are scoped to one iteration
+          const std::string counter = gen->frame_slot(gen->m_next_loop++);
+          const std::string top = gen->new_label("repeat");
+          gen->m_output << "    mov rax, " << stmt_repeat->count << "\n";
+          gen->m_output << "    mov " << counter << ", rax\n";
+          // padding is run once on the way in, not per iteration
+          if (gen->m_layout.loop_align)
+            gen->m_output << "    align " << gen->m_layout.loop_align << "\n";
+          gen->m_output << top << ":\n";
+          const size_t scope = gen->begin_scope();
+          for (const NodeStmt *stmt : stmt_repeat->body)
+            gen->gen_stmt(stmt);
+          gen->end_scope(scope);
+          gen->m_output << "    dec " << counter << "\n";
+          gen->m_output << "    jnz " << top << "\n";
+        }
+
+        void operator()(const NodeStmtStart *) const
         {
           // start main for pthread calls
           gen->m_output << "section .text\n";
@@ -136,98 +332,113 @@ class Generator
           gen->m_output << "    push rbp\n";
           gen->m_output << "    mov rbp, rsp\n";
           gen->m_output << "    sub rsp, 16\n";
-          gen->m_output << "    ;globals init\n";
-          for (auto *stmt : gen->m_prog.stmts)
+          gen->gen_global_init();
+
+          // main only starts the root of the spawn tree and joins it, the
+          // tree fans every worker replica out and back in (see gen_spawner)
+          gen->m_output << "    ; spawn tree root\n";
+          gen->m_output << "    lea rdi, [rel thread_ids]\n";
+          gen->m_output << "    xor rsi, rsi\n";
+          gen->m_output << "    lea rdx, [rel hy_spawn]\n";
+          gen->m_output << "    xor rcx, rcx\n";
+          gen->m_output << "    call pthread_create\n";
+          gen->m_output << "    test eax, eax\n";
+          gen->m_output << "    jnz hy_spawn_failed\n";
+          gen->m_output << "    mov rdi, [rel thread_ids]\n";
+          gen->m_output << "    xor rsi, rsi\n";
+          gen->m_output << "    call pthread_join\n";
+
+          // main keeps going with the statements after start_workers(),
+          // gen_prog closes it once they are all emitted
+          gen->in_main = true;
+        }
+
+        void operator()(const NodeStmtReport *stmt_report) const
+        {
+          if (gen->in_worker)
           {
-            // if is NodeGlobalStmtLet
-            if (auto global_stmt = std::get_if<NodeGlobalStmtLet*>(&stmt->var))
-            {
-              NodeGlobalStmtLet * g = *global_stmt;
-              gen->gen_expr(g->expr);
-              gen->pop("rax");
-              gen->m_output
-                << "    mov [rel " << g->ident.value.value() << "], rax\n";
-            }
+            std::cerr << "report inside worker not allowed\n";
+            std::exit(EXIT_FAILURE);
           }
-
-          // Spawn workers
-          std::size_t i = 0;
-          for (const NodeWorker *worker : gen->m_prog.workers)
+          if (!gen->m_prog.workers.empty() && !gen->in_main)
           {
-            const std::string worker_name = worker->ident.value.value();
-
-            gen->m_output << "    ; pthread_create for " << worker_name << "\n";
-            // pthread_create(&thread_ids[i], NULL, worker_fn, NULL)
-            gen->m_output << "    lea rdi, [rel thread_ids + " << (i * 8) << "]\n";
-            gen->m_output << "    xor rsi, rsi\n";
-            gen->m_output << "    lea rdx, [rel " << worker_name << "]\n";
-            gen->m_output << "    xor rcx, rcx\n";
-            gen->m_output << "    call pthread_create\n";
-
-            ++i;
+            std::cerr << "report before start_workers() not allowed\n";
+            std::exit(EXIT_FAILURE);
           }
 
-          // Join workers
-          i = 0;
-          for (const NodeWorker *w : gen->m_prog.workers)
+          gen->m_output << "    ; report\n";
+          const auto &exprs = stmt_report->exprs;
+          for (size_t i = 0; i < exprs.size(); i++)
           {
-            // pthread_join(&thread_ids[i], NULL)
-            gen->m_output << "    ; pthread_join for worker " << i << "\n";
-            gen->m_output << "    mov rdi, [rel thread_ids + " << (i * 8) << "]\n";
-            gen->m_output << "    xor rsi, rsi\n";
-            gen->m_output << "    call pthread_join\n";
-
-            ++i;
+            const std::string label = expr_to_string(exprs.at(i));
+            switch (gen->m_format)
+            {
+              case ReportFormat::text:
+                gen->out_str(label + ": ");
+                break;
+              case ReportFormat::csv:
+                if (i > 0)
+                  gen->out_str(",");
+                break;
+              case ReportFormat::json:
+                gen->out_str((i == 0 ? "{\"" : ",\"") + label + "\":");
+                break;
+            }
+            gen->gen_expr(exprs.at(i));
+            gen->pop("rdi");
+            gen->m_output << "    call hy_out_i64\n";
+            if (gen->m_format == ReportFormat::text)
+              gen->out_str("\n");
           }
-
-          // Print after join
-          gen->m_output << "    ; print a\n";
-          gen->m_output << "    mov rdi, fmt_a\n";
-          gen->m_output << "    mov rsi, [rel a]\n";
-          gen->m_output << "    xor rax, rax\n";
-          gen->m_output << "    call printf\n";
-
-          gen->m_output << "    ; print b\n";
-          gen->m_output << "    mov rdi, fmt_b\n";
-          gen->m_output << "    mov rsi, [rel b]\n";
-          gen->m_output << "    xor rax, rax\n";
-          gen->m_output << "    call printf\n";
-
-          // Return from main
-          gen->m_output << "    mov eax, 0\n";
-          gen->m_output << "    leave\n";
-          gen->m_output << "    ret\n";
+          if (gen->m_format == ReportFormat::csv)
+            gen->out_str("\n");
+          else if (gen->m_format == ReportFormat::json)
+            gen->out_str("}\n");
         }
 
         void operator()(const NodeStmtAssign* stmt_assign) const
         {
           // check if the variable was declared
           const auto &name = stmt_assign->ident.value.value();
+          if (gen->m_vars.contains(name))
+          {
+            if (stmt_assign->index)
+            {
+              std::cerr << "Indexing a local that is not an array: " << name << std::endl;
+              std::exit(EXIT_FAILURE);
+            }
+            gen->gen_expr(stmt_assign->expr);
+            gen->pop("rax");
+            gen->m_output << "    mov " << gen->m_vars.at(name).loc << ", rax\n";
+            return;
+          }
           if (!gen->m_globals.contains(name))
           {
             std::cerr << "Undeclared global identifier in assignment: " << name << std::endl;
             std::exit(EXIT_FAILURE);
           }
 
+          if (stmt_assign->index)
+          {
+            // index first, then the value, same order the simulator reads them
+            gen->check_index(stmt_assign->ident, stmt_assign->index);
+            gen->gen_expr(stmt_assign->index);
+            gen->gen_expr(stmt_assign->expr);
+            gen->pop("rax");
+            gen->gen_element_addr(stmt_assign->ident, stmt_assign->index, false);
+            gen->m_output << "    mov [rdx + rcx*8], rax\n";
+            return;
+          }
+          if (gen->m_globals.at(name) != 0)
+          {
+            std::cerr << "Global array assigned without an index: " << name << std::endl;
+            std::exit(EXIT_FAILURE);
+          }
+
           gen->gen_expr(stmt_assign->expr);
           gen->pop("rax");
           // Store into global memory
           gen->m_output << "    mov [rel " << name << "], rax\n";
-          // if (!gen->m_vars.contains(name))
-          // {
-          //   std::cerr << "Undeclared identifier in assignment: " << name << std::endl;
-          //   std::exit(EXIT_FAILURE);
-          // }
-          //
-          // gen->gen_expr(stmt_assign->expr);
-          // gen->pop("rax");
-          //
-          // const auto &var = gen->m_vars.at(name);
-          // //get variable offset
-          // std::stringstream offset;
-          // offset << "QWORD [rsp + " << (gen->m_stack_size - var.stack_loc - 1) * 8 << "]";
-          // // Temp RAX save into offset, assigning loc in mem with new value
-          // gen->m_output << "    mov " << offset.str() << ", rax\n";
         }
       };
 
@@ -235,65 +446,491 @@ class Generator
       std::visit(visitor, stmt->var);
     }
 
+    // .bss has no initial values, every global gets its initializer stored
+    // before anything else runs
+    void gen_global_init()
+    {
+      m_output << "    ;globals init\n";
+      for (auto *stmt : m_prog.stmts)
+      {
+        // if is NodeGlobalStmtLet
+        if (auto global_stmt = std::get_if<NodeGlobalStmtLet*>(&stmt->var))
+        {
+          NodeGlobalStmtLet * g = *global_stmt;
+          const std::string name = g->ident.value.value();
+          gen_expr(g->expr);
+          pop("rax");
+          if (g->length == 0)
+          {
+            m_output << "    mov [rel " << name << "], rax\n";
+            continue;
+          }
+          // arrays: the initializer is evaluated once and copied to every element
+          const std::string loop = new_label("init_" + name);
+          m_output << "    lea rdi, [rel " << name << "]\n";
+          m_output << "    mov rcx, " << g->length << "\n";
+          m_output << loop << ":\n";
+          m_output << "    mov [rdi], rax\n";
+          m_output << "    add rdi, 8\n";
+          m_output << "    dec rcx\n";
+          m_output << "    jnz " << loop << "\n";
+        }
+      }
+    }
+
+    // frame: [rbp - 8] is the thread index, then one trip counter per
+    // repeat, then the saved callee-saved registers, then stack slots for
+    // locals that didn't get a register. a worker never has more locals live
+    // than it has lets, so counting both sizes the frame up front
     void gen_worker(const NodeWorker *worker)
      {
-       m_output << worker->ident.value.value() << ":\n";
+       size_t lets = 0;
+       m_loop_slots = 0;
+       count_frame_slots(worker->body, lets, m_loop_slots);
+       m_next_loop = 0;
+       m_saved_regs = std::min(lets, local_regs.size());
+       const size_t slots = 1 + m_loop_slots + lets;
+       // keep rsp 16-byte aligned for the calls expressions may make later
+       const size_t frame = (slots * 8 + 15) / 16 * 16;
+
+       const std::string &name = worker->ident.value.value();
+       if (m_layout.worker_sections)
+         m_output << "section .text.hy_" << name << " progbits alloc exec nowrite align=" << page_size << "\n";
+       else if (m_layout.worker_align)
+         m_output << "    align " << m_layout.worker_align << "\n";
+       m_output << name << ":\n";
        m_output << "    push rbp\n";
        m_output << "    mov rbp, rsp\n";
+       // rdi is the thread index handed over by the spawn tree, read by `tid`
+       m_output << "    sub rsp, " << frame << "\n";
+       m_output << "    mov [rbp - 8], rdi\n";
+       for (size_t i = 0; i < m_saved_regs; i++)
+         m_output << "    mov " << frame_slot(m_loop_slots + i) << ", " << local_regs.at(i) << "\n";
 
-       // resetting local scope, and worker state will affect statement handling
-       // TODO: Once I figure out local handling, this is will be useful
+       // locals are scoped to the worker body
        this->m_stack_size = 0;
        this->in_worker = true;
+       const size_t scope = begin_scope();
        for (const NodeStmt *stmt : worker->body)
          gen_stmt(stmt);
+       end_scope(scope);
 
+       for (size_t i = 0; i < m_saved_regs; i++)
+         m_output << "    mov " << local_regs.at(i) << ", " << frame_slot(m_loop_slots + i) << "\n";
        // Return NULL for pthread
        m_output << "    xor rax, rax\n";
-       m_output << "    pop rbp\n";
+       m_output << "    leave\n";
        m_output << "    ret\n";
+       end_function(name);
        in_worker = false;
      }
 
+    // every replica of every worker gets a slot k, worker `w[4]` fills four
+    // consecutive slots with tids 0..3. hy_spawn(k) is the pthread entry for
+    // slot k: it creates slots 2k+1 and 2k+2, runs its own worker, then joins
+    // the two children. thread creation and joining happen log2(T) deep in
+    // parallel instead of T times in a row on main
+    void gen_spawner()
+     {
+       size_t slots = 0;
+       for (const NodeWorker *worker : m_prog.workers)
+         slots += worker->replicas;
+
+       m_output << "section .data\n";
+       m_output << "    align 8\n";
+       m_output << "hy_thread_fn:\n";
+       for (const NodeWorker *worker : m_prog.workers)
+         for (size_t r = 0; r < worker->replicas; r++)
+           m_output << "    dq " << worker->ident.value.value() << "\n";
+       m_output << "hy_thread_tid:\n";
+       for (const NodeWorker *worker : m_prog.workers)
+         for (size_t r = 0; r < worker->replicas; r++)
+           m_output << "    dq " << r << "\n";
+
+       m_output << "section .text\n";
+       // every thread enters through here before its worker
+       if (m_layout.worker_align)
+         m_output << "    align " << m_layout.worker_align << "\n";
+       m_output << "hy_spawn:\n";
+       // rbx holds the slot, r12 the first child, both survive the calls
+       m_output << "    push rbx\n";
+       m_output << "    push r12\n";
+       m_output << "    sub rsp, 8\n";
+       m_output << "    mov rbx, rdi\n";
+       m_output << "    lea r12, [rdi + rdi + 1]\n";
+       for (size_t child = 0; child < 2; child++)
+       {
+         const std::string skip = "hy_spawn_skip_" + std::to_string(child);
+         m_output << "    lea rcx, [r12 + " << child << "]\n";
+         m_output << "    cmp rcx, " << slots << "\n";
+         m_output << "    jae " << skip << "\n";
+         m_output << "    lea rdi, [rel thread_ids]\n";
+         m_output << "    lea rdi, [rdi + rcx*8]\n";
+         m_output << "    xor rsi, rsi\n";
+         m_output << "    lea rdx, [rel hy_spawn]\n";
+         m_output << "    call pthread_create\n";
+         // an unset thread id would crash pthread_join later
+         m_output << "    test eax, eax\n";
+         m_output << "    jnz hy_spawn_failed\n";
+         m_output << skip << ":\n";
+       }
+       // run this slot's own worker with its replica index
+       m_output << "    lea rax, [rel hy_thread_tid]\n";
+       m_output << "    mov rdi, [rax + rbx*8]\n";
+       m_output << "    lea rax, [rel hy_thread_fn]\n";
+       m_output << "    call [rax + rbx*8]\n";
+       for (size_t child = 0; child < 2; child++)
+       {
+         const std::string skip = "hy_join_skip_" + std::to_string(child);
+         m_output << "    lea rcx, [r12 + " << child << "]\n";
+         m_output << "    cmp rcx, " << slots << "\n";
+         m_output << "    jae " << skip << "\n";
+         m_output << "    lea rax, [rel thread_ids]\n";
+         m_output << "    mov rdi, [rax + rcx*8]\n";
+         m_output << "    xor rsi, rsi\n";
+         m_output << "    call pthread_join\n";
+         m_output << skip << ":\n";
+       }
+       m_output << "    xor rax, rax\n";
+       m_output << "    add rsp, 8\n";
+       m_output << "    pop r12\n";
+       m_output << "    pop rbx\n";
+       m_output << "    ret\n";
+       end_function("hy_spawn");
+
+       // pthread_create failed (EAGAIN with too many replicas), report it and
+       // take the whole process down with exit_group(1)
+       const std::string msg = "pthread_create failed, could not start every worker";
+       m_output << "section .rodata\n";
+       m_output << "hy_spawn_failed_msg: db \"" << msg << "\", 10\n";
+       m_output << "section .text\n";
+       m_output << "hy_spawn_failed:\n";
+       m_output << "    mov rax, 1\n";
+       m_output << "    mov rdi, 2\n";
+       m_output << "    lea rsi, [rel hy_spawn_failed_msg]\n";
+       m_output << "    mov rdx, " << msg.size() + 1 << "\n";
+       m_output << "    syscall\n";
+       m_output << "    mov rax, 231\n";
+       m_output << "    mov rdi, 1\n";
+       m_output << "    syscall\n";
+     }
+
 
     [[nodiscard]] std::string gen_prog()
      {
        if (!m_prog.workers.empty())
        {
          m_output << "default rel\n";
-         m_output << "section .text\n";
+         // nasm keeps .text at 16 bytes unless told, `align` alone can't go past that
+         m_output << "section .text";
+         if (text_align() > 16)
+           m_output << " align=" << text_align();
+         m_output << "\n";
          m_output << "    global main\n";
          m_output << "    extern pthread_create\n";
          m_output << "    extern pthread_join\n";
-         m_output << "    extern printf\n";
-
-         m_output << "section .rodata\n";
-         m_output << "    fmt_a: db \"a: %ld\", 10, 0\n";
-         m_output << "    fmt_b: db \"b: %ld\", 10, 0\n";
 
          // undeclared thread ids
          m_output << "section .bss\n";
-         m_output << "    thread_ids: resq " << m_prog.workers.size() << "\n";
+         size_t slots = 0;
+         for (const NodeWorker *worker : m_prog.workers)
+           slots += worker->replicas;
+         m_output << "    thread_ids: resq " << slots << "\n";
 
          for (const NodeStmt *stmt : m_prog.stmts)
            gen_stmt(stmt);
 
+         if (in_main)
+         {
+           if (m_has_reports)
+             m_output << "    call hy_flush\n";
+           // Return from main
+           m_output << "    mov eax, 0\n";
+           m_output << "    leave\n";
+           m_output << "    ret\n";
+           end_function("main");
+           in_main = false;
+         }
+
          for (const NodeWorker *worker : m_prog.workers)
            gen_worker(worker);
 
+         gen_spawner();
+         gen_report_runtime();
          return m_output.str();
        }
 
+       // globals are reserved in .bss and set at the top of _start, like main
+       // does it for programs with workers
+       m_output << "default rel\n";
+       m_output << "section .bss\n";
+       for (const NodeStmt *stmt : m_prog.stmts)
+         if (std::holds_alternative<NodeGlobalStmtLet*>(stmt->var))
+           gen_stmt(stmt);
+       m_output << "section .text\n";
        m_output << "global _start\n_start:\n";
+       gen_global_init();
        for (const NodeStmt *stmt : m_prog.stmts)
-         gen_stmt(stmt);
+         if (!std::holds_alternative<NodeGlobalStmtLet*>(stmt->var))
+           gen_stmt(stmt);
+
+       if (m_has_reports)
+       {
+         // falling off the end would lose the buffered results, flush and exit(0)
+         m_output << "    call hy_flush\n";
+         m_output << "    mov rax, 60\n";
+         m_output << "    xor rdi, rdi\n";
+         m_output << "    syscall\n";
+       }
 
+       gen_report_runtime();
        return m_output.str();
      }
 
 
   private:
 
+      static constexpr size_t report_buffer_size = 65536;
+      static constexpr size_t cache_line = 64;
+      static constexpr size_t cpu_mask_bytes = 128;
+      static constexpr size_t page_size = 4096;
+
+      // callee-saved, so pthread and the report runtime leave them alone
+      static constexpr std::array<const char*, 5> local_regs {"rbx", "r12", "r13", "r14", "r15"};
+
+      // where the n-th live local of the current worker is kept: the first ones
+      // get registers, the rest go below the saved registers in the frame
+      std::string local_loc(size_t n) const
+      {
+        if (n < local_regs.size())
+          return local_regs.at(n);
+        return frame_slot(m_loop_slots + m_saved_regs + n - local_regs.size());
+      }
+
+      // the i-th qword of a worker frame below the thread index
+      static std::string frame_slot(size_t i)
+      {
+        return "QWORD [rbp - " + std::to_string(16 + i * 8) + "]";
+      }
+
+      static void count_frame_slots(const std::vector<NodeStmt*> &body, size_t &lets, size_t &loops)
+      {
+        for (const NodeStmt *stmt : body)
+        {
+          if (std::holds_alternative<NodeStmtLet*>(stmt->var))
+            lets++;
+          else if (auto repeat = std::get_if<NodeStmtRepeat*>(&stmt->var))
+          {
+            loops++;
+            count_frame_slots((*repeat)->body, lets, loops);
+          }
+        }
+      }
+
+      size_t text_align() const
+      {
+        return std::max<size_t>({16, m_layout.worker_align, m_layout.loop_align});
+      }
+
+      // marks where a function's code stops, for the code layout report
+      void end_function(const std::string &name)
+      {
+        m_output << "hy_end_" << name << ":\n";
+      }
+
+      // atomics and await only make sense on shared memory
+      void check_shared_target(const Token &ident, const NodeExpr *index) const
+      {
+        const std::string &name = ident.value.value();
+        if (m_vars.contains(name))
+        {
+          std::cerr << "Atomic operation on a local, only globals are shared: " << name << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        if (!m_globals.contains(name))
+        {
+          std::cerr << "Undeclared Global Identifier:  " << name << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        if (index)
+          check_index(ident, index);
+        else if (m_globals.at(name) != 0)
+        {
+          std::cerr << "Global array used without an index: " << name << std::endl;
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      size_t begin_scope() const
+      {
+        return m_scope_vars.size();
+      }
+
+      // drops every local declared since begin_scope, their slots get reused
+      void end_scope(size_t scope)
+      {
+        while (m_scope_vars.size() > scope)
+        {
+          m_vars.erase(m_scope_vars.back());
+          m_scope_vars.pop_back();
+        }
+      }
+
+      std::string new_label(const std::string &hint)
+      {
+        return "hy_" + hint + "_" + std::to_string(m_label_count++);
+      }
+
+      // checks that ident names an array and that a literal index is in range,
+      // anything else is trusted at run time
+      void check_index(const Token &ident, const NodeExpr *index) const
+      {
+        const std::string name = ident.value.value();
+        if (!m_globals.contains(name))
+        {
+          std::cerr << "Undeclared Global Identifier:  " << name << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        const size_t length = m_globals.at(name);
+        if (length == 0)
+        {
+          std::cerr << "Indexing a global that is not an array: " << name << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        if (auto term = std::get_if<NodeTerm*>(&index->var))
+          if (auto lit = std::get_if<NodeTermIntLit*>(&(*term)->var))
+            if (std::stoull((*lit)->int_lit.value.value()) >= length)
+            {
+              std::cerr << "Index out of range for " << name << "[" << length << "]" << std::endl;
+              exit(EXIT_FAILURE);
+            }
+      }
+
+      // leaves &name[index] as rdx + rcx*8. with evaluate unset the index was
+      // already pushed and is the next value on the expression stack
+      void gen_element_addr(const Token &ident, const NodeExpr *index, bool evaluate = true)
+      {
+        check_index(ident, index);
+        if (evaluate)
+          gen_expr(index);
+        pop("rcx");
+        m_output << "    lea rdx, [rel " << ident.value.value() << "]\n";
+      }
+
+      // appends a constant string to the report buffer, the bytes go to .rodata
+      void out_str(const std::string &str)
+      {
+        const std::string label = "hy_str_" + std::to_string(m_strings.size());
+        m_strings.push_back(str);
+        m_output << "    lea rsi, [rel " << label << "]\n";
+        m_output << "    mov rdx, " << str.size() << "\n";
+        m_output << "    call hy_out_str\n";
+      }
+
+      // results are formatted into one buffer and written with a single write(2)
+      // when the program ends (or when the buffer fills), instead of one libc
+      // printf per value. the routines only touch caller-saved registers
+      void gen_report_runtime()
+      {
+        if (!m_has_reports)
+          return;
+
+        m_output << "section .text\n";
+        // hy_flush: write(1, hy_out_buf, hy_out_len) until everything is out
+        m_output << "hy_flush:\n";
+        m_output << "    lea rsi, [rel hy_out_buf]\n";
+        m_output << "    mov rdx, [rel hy_out_len]\n";
+        m_output << "hy_flush_loop:\n";
+        m_output << "    test rdx, rdx\n";
+        m_output << "    jz hy_flush_done\n";
+        m_output << "    mov rax, 1\n";
+        m_output << "    mov rdi, 1\n";
+        m_output << "    syscall\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jle hy_flush_done\n";
+        m_output << "    add rsi, rax\n";
+        m_output << "    sub rdx, rax\n";
+        m_output << "    jmp hy_flush_loop\n";
+        m_output << "hy_flush_done:\n";
+        m_output << "    mov QWORD [rel hy_out_len], 0\n";
+        m_output << "    ret\n";
+
+        // hy_out_str: append rdx bytes from rsi
+        m_output << "hy_out_str:\n";
+        m_output << "    mov rax, [rel hy_out_len]\n";
+        m_output << "    lea rcx, [rax + rdx]\n";
+        m_output << "    cmp rcx, " << report_buffer_size << "\n";
+        m_output << "    jbe hy_out_str_copy\n";
+        m_output << "    push rsi\n";
+        m_output << "    push rdx\n";
+        m_output << "    call hy_flush\n";
+        m_output << "    pop rdx\n";
+        m_output << "    pop rsi\n";
+        m_output << "    xor eax, eax\n";
+        m_output << "hy_out_str_copy:\n";
+        m_output << "    lea rdi, [rel hy_out_buf]\n";
+        m_output << "    add rdi, rax\n";
+        m_output << "    add rax, rdx\n";
+        m_output << "    mov [rel hy_out_len], rax\n";
+        m_output << "hy_out_str_loop:\n";
+        m_output << "    test rdx, rdx\n";
+        m_output << "    jz hy_out_str_done\n";
+        m_output << "    mov cl, [rsi]\n";
+        m_output << "    mov [rdi], cl\n";
+        m_output << "    inc rsi\n";
+        m_output << "    inc rdi\n";
+        m_output << "    dec rdx\n";
+        m_output << "    jmp hy_out_str_loop\n";
+        m_output << "hy_out_str_done:\n";
+        m_output << "    ret\n";
+
+        // hy_out_i64: append rdi in decimal, digits are built backwards on the stack
+        m_output << "hy_out_i64:\n";
+        m_output << "    sub rsp, 32\n";
+        m_output << "    mov rax, rdi\n";
+        m_output << "    mov r8, rdi\n";
+        m_output << "    lea rsi, [rsp + 32]\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jns hy_out_i64_digits\n";
+        // INT64_MIN stays negative, but divided as unsigned it is still right
+        m_output << "    neg rax\n";
+        m_output << "hy_out_i64_digits:\n";
+        m_output << "    mov rcx, 10\n";
+        m_output << "hy_out_i64_loop:\n";
+        m_output << "    xor edx, edx\n";
+        m_output << "    div rcx\n";
+        m_output << "    add rdx, 48\n";
+        m_output << "    dec rsi\n";
+        m_output << "    mov [rsi], dl\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jnz hy_out_i64_loop\n";
+        m_output << "    test r8, r8\n";
+        m_output << "    jns hy_out_i64_emit\n";
+        m_output << "    dec rsi\n";
+        m_output << "    mov BYTE [rsi], 45\n";
+        m_output << "hy_out_i64_emit:\n";
+        m_output << "    lea rdx, [rsp + 32]\n";
+        m_output << "    sub rdx, rsi\n";
+        m_output << "    call hy_out_str\n";
+        m_output << "    add rsp, 32\n";
+        m_output << "    ret\n";
+
+        m_output << "section .rodata\n";
+        for (size_t i = 0; i < m_strings.size(); i++)
+        {
+          m_output << "    hy_str_" << i << ": db ";
+          // plain bytes, the labels may hold quotes and newlines
+          const std::string &str = m_strings.at(i);
+          for (size_t c = 0; c < str.size(); c++)
+            m_output << (c ? ", " : "") << static_cast<int>(static_cast<unsigned char>(str.at(c)));
+          m_output << "\n";
+        }
+
+        m_output << "section .bss\n";
+        m_output << "    hy_out_len: resq 1\n";
+        m_output << "    hy_out_buf: resb " << report_buffer_size << "\n";
+      }
+
       // function to keep track of current identifier or literal location in registers
       void push(const std::string &reg)
       {
@@ -310,14 +947,28 @@ class Generator
       // could include "types", int literals are enough to test asm threading
       struct Var
       {
-        size_t stack_loc = 0;
+        // register or frame slot operand
+        std::string loc;
       };
 
       const NodeProg m_prog;
+      const ReportFormat m_format;
+      const CodeLayout m_layout;
       std::stringstream m_output;
       size_t m_stack_size = 0;
       bool in_worker = false;
-      // we are just doing global for now
-      // std::unordered_map<std::string, Var> m_vars {};
-      std::unordered_set<std::string> m_globals {};
+      // emitting main's statements after start_workers()
+      bool in_main = false;
+      bool m_has_reports = false;
+      std::vector<std::string> m_strings {};
+      // locals of the worker being generated, in declaration order for scoping
+      std::unordered_map<std::string, Var> m_vars {};
+      std::vector<std::string> m_scope_vars {};
+      size_t m_saved_regs = 0;
+      // repeat trip counters of the current worker
+      size_t m_loop_slots = 0;
+      size_t m_next_loop = 0;
+      // global name -> array length, 0 for plain scalars
+      std::unordered_map<std::string, size_t> m_globals {};
+      size_t m_label_count = 0;
     };
\ No newline at end of file
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "./assembler.hpp"
+#include "./layout.hpp"
+
+// loads the Generator's output into executable memory inside the compiler process.
+// text goes into read+exec pages, rodata/data/bss and one address slot per extern
+// follow in read+write pages of the same mapping, so every rip-relative reference
+// stays within reach of a 32-bit displacement. with `huge_pages` the mapping
+// starts on a 2 MiB boundary and its text is madvise'd for transparent huge pages
+class JitImage
+{
+public:
+    explicit JitImage(const std::string &asm_src, bool huge_pages = false)
+    {
+        Assembler assembler(asm_src);
+        assembler.assemble();
+        load(assembler, huge_pages);
+    }
+
+    JitImage(const JitImage &other) = delete;
+    JitImage operator=(const JitImage &other) = delete;
+
+    ~JitImage()
+    {
+        if (m_base)
+            munmap(m_base, m_size);
+    }
+
+    [[nodiscard]] void *symbol(const std::string &name) const
+    {
+        if (!m_addresses.contains(name))
+        {
+            std::cerr << "JIT: no symbol `" << name << "`" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return m_addresses.at(name);
+    }
+
+    // every label in text with its final address, for the code layout report
+    [[nodiscard]] std::vector<LayoutSymbol> text_symbols() const
+    {
+        std::vector<LayoutSymbol> symbols;
+        for (const auto &[name, address] : m_addresses)
+            if (address >= m_base && address < m_base + m_text_size)
+                symbols.push_back({.name = name, .address = reinterpret_cast<uint64_t>(address)});
+        return symbols;
+    }
+
+    // runs the program the same way the linked binary would start it: `main` when
+    // there are workers, otherwise `_start` (whose exit syscall ends the process)
+    int run() const
+    {
+        std::cout.flush();
+        if (m_addresses.contains("main"))
+            return reinterpret_cast<int (*)()>(symbol("main"))();
+        reinterpret_cast<void (*)()>(symbol("_start"))();
+        return EXIT_SUCCESS;
+    }
+
+private:
+    static size_t align_up(size_t n, size_t align)
+    {
+        return (n + align - 1) / align * align;
+    }
+
+    static constexpr size_t huge_page = 2 * 1024 * 1024;
+
+    void load(const Assembler &assembler, bool huge_pages)
+    {
+        const auto &sections = assembler.sections();
+        const size_t page = huge_pages ? huge_page : static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        // falling off the end of a text section returns 0 instead of running into garbage
+        static const uint8_t ret_stub[] = {0x31, 0xC0, 0xC3};
+
+        std::vector<size_t> offsets(sections.size());
+        size_t size = 0;
+        for (size_t i = 0; i < sections.size(); i++)
+        {
+            if (sections.at(i).kind != SectionKind::text)
+                continue;
+            size = align_up(size, sections.at(i).align);
+            offsets.at(i) = size;
+            size += sections.at(i).size() + sizeof(ret_stub);
+        }
+        const size_t text_size = align_up(std::max<size_t>(size, 1), page);
+        size = text_size;
+        for (SectionKind kind : {SectionKind::rodata, SectionKind::data, SectionKind::bss})
+        {
+            for (size_t i = 0; i < sections.size(); i++)
+            {
+                if (sections.at(i).kind != kind)
+                    continue;
+                size = align_up(size, sections.at(i).align);
+                offsets.at(i) = size;
+                size += sections.at(i).size();
+            }
+        }
+        size = align_up(size, 8);
+        const size_t slots = size;
+        size += assembler.externs().size() * 8;
+        m_size = align_up(size, page);
+
+        // mmap only promises small page alignment, map a huge page extra and trim
+        const size_t slack = huge_pages ? huge_page : 0;
+        void *mem = mmap(nullptr, m_size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            std::cerr << "JIT: mmap failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        m_base = static_cast<uint8_t*>(mem);
+        if (huge_pages)
+        {
+            uint8_t *aligned = reinterpret_cast<uint8_t*>(align_up(reinterpret_cast<size_t>(m_base), huge_page));
+            if (aligned != m_base)
+                munmap(m_base, static_cast<size_t>(aligned - m_base));
+            if (aligned + m_size != m_base + m_size + slack)
+                munmap(aligned + m_size, static_cast<size_t>(m_base + slack - aligned));
+            m_base = aligned;
+            // only a hint, without THP the text stays on small pages
+            madvise(m_base, text_size, MADV_HUGEPAGE);
+        }
+        m_text_size = text_size;
+
+        for (size_t i = 0; i < sections.size(); i++)
+        {
+            const AsmSection &s = sections.at(i);
+            if (s.kind == SectionKind::bss)
+                continue;
+            memcpy(m_base + offsets.at(i), s.bytes.data(), s.bytes.size());
+            if (s.kind == SectionKind::text)
+                memcpy(m_base + offsets.at(i) + s.bytes.size(), ret_stub, sizeof(ret_stub));
+        }
+
+        for (const auto &[name, sym] : assembler.symbols())
+            m_addresses[name] = m_base + offsets.at(sym.section) + sym.offset;
+
+        std::unordered_map<std::string, uint8_t*> slot_of;
+        for (size_t i = 0; i < assembler.externs().size(); i++)
+        {
+            const std::string &name = assembler.externs().at(i);
+            void *fn = dlsym(RTLD_DEFAULT, name.c_str());
+            if (!fn)
+            {
+                std::cerr << "JIT: unresolved extern `" << name << "`" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            uint8_t *slot = m_base + slots + i * 8;
+            memcpy(slot, &fn, sizeof(fn));
+            slot_of[name] = slot;
+            if (!m_addresses.contains(name))
+                m_addresses[name] = static_cast<uint8_t*>(fn);
+        }
+
+        for (const AsmFixup &fixup : assembler.fixups())
+        {
+            uint8_t *site = m_base + offsets.at(fixup.section) + fixup.offset;
+            uint8_t *target;
+            if (fixup.via_slot)
+                target = slot_of.at(fixup.symbol);
+            else if (m_addresses.contains(fixup.symbol))
+                target = m_addresses.at(fixup.symbol);
+            else
+            {
+                std::cerr << "JIT: undefined symbol `" << fixup.symbol << "`" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            target += fixup.addend;
+
+            if (fixup.kind == AsmFixup::Kind::abs64)
+            {
+                const uint64_t value = reinterpret_cast<uint64_t>(target);
+                memcpy(site, &value, sizeof(value));
+                continue;
+            }
+            const int64_t rel = target - (m_base + offsets.at(fixup.section) + fixup.next_ip);
+            if (rel < INT32_MIN || rel > INT32_MAX)
+            {
+                std::cerr << "JIT: `" << fixup.symbol << "` is out of rel32 range" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            const int32_t value = static_cast<int32_t>(rel);
+            memcpy(site, &value, sizeof(value));
+        }
+
+        if (mprotect(m_base, text_size, PROT_READ | PROT_EXEC) != 0)
+        {
+            std::cerr << "JIT: could not make code executable" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint8_t *m_base = nullptr;
+    size_t m_size = 0;
+    size_t m_text_size = 0;
+    std::unordered_map<std::string, uint8_t*> m_addresses;
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+
+#include "./jit.hpp"
+#include "./toolchain.hpp"
+#include "./tsc.hpp"
+
+struct LatencyConfig
+{
+    // CPUs to probe, every CPU this process may run on when empty
+    std::vector<size_t> cpus;
+    // timed round trips per pair, after `warmup` untimed ones
+    size_t rounds = 10000;
+    size_t warmup = 1000;
+};
+
+// core-to-core latency. for every ordered pair of CPUs a `.hy` program pins a
+// `ping` worker to the first and a `pong` worker to the second, and the two
+// bounce a counter through a global that sits alone on its cache line: ping
+// stores an odd value and awaits the next even one, pong awaits the odd value
+// and answers with the even one. ping reads the cycle counter with rdtscp around
+// the timed rounds, so each pair costs one cache line transfer there and one
+// back per round. programs are run through the JIT, one per pair
+class LatencyProbe
+{
+public:
+    explicit LatencyProbe(LatencyConfig config)
+        : m_config(std::move(config)) {}
+
+    // returns the number of pairs whose ball didn't end where it should
+    size_t run()
+    {
+        using namespace std;
+        vector<size_t> cpus = m_config.cpus.empty() ? allowed_cpus() : m_config.cpus;
+        if (cpus.size() < 2)
+        {
+            cout << "latency probe needs at least 2 CPUs, this process may only run on " << cpus.size() << endl;
+            return 0;
+        }
+        check_allowed(cpus);
+
+        const double ghz = tsc_ghz();
+        cout << "tsc " << fixed << setprecision(3) << ghz << " GHz, " << m_config.rounds << " round trips per pair, "
+             << "one-way latency in ns (row pings, column pongs)\n";
+        cout << setw(8) << "cpu";
+        for (size_t cpu : cpus)
+            cout << ' ' << setw(8) << cpu;
+        cout << "\n";
+
+        size_t bad = 0;
+        vector<double> all;
+        for (size_t i = 0; i < cpus.size(); i++)
+        {
+            cout << setw(8) << cpus.at(i) << flush;
+            for (size_t j = 0; j < cpus.size(); j++)
+            {
+                if (i == j)
+                {
+                    cout << ' ' << setw(8) << "-";
+                    continue;
+                }
+                const optional<double> cycles = round_trip_cycles(cpus.at(i), cpus.at(j));
+                if (!cycles.has_value())
+                {
+                    bad++;
+                    cout << ' ' << setw(8) << "?" << flush;
+                    continue;
+                }
+                // half a round trip per direction
+                const double ns = cycles.value() / ghz / 2.0;
+                all.push_back(ns);
+                cout << ' ' << setw(8) << setprecision(1) << ns << flush;
+            }
+            cout << "\n";
+        }
+        if (!all.empty())
+        {
+            sort(all.begin(), all.end());
+            double sum = 0;
+            for (double ns : all)
+                sum += ns;
+            cout << setprecision(1) << "min " << all.front() << " ns, median " << all.at(all.size() / 2)
+                 << " ns, mean " << sum / static_cast<double>(all.size()) << " ns, max " << all.back() << " ns\n";
+        }
+        cout << defaultfloat << setprecision(6);
+        cout.flush();
+        return bad;
+    }
+
+    static std::string emit(size_t ping, size_t pong, size_t warmup, size_t rounds)
+    {
+        // ball[0] alone on its cache line, the rest is padding
+        std::stringstream src;
+        src << "global let ball[8] = 0;\n";
+        src << "global let t0 = 0;\n";
+        src << "global let t1 = 0;\n";
+
+        const std::string serve = "    ball[0] = v;\n    await(ball[0], v + 1);\n    v = v + 2;\n";
+        src << "|| ping\n";
+        src << "pin(" << ping << ");\n";
+        src << "let v = 1;\n";
+        if (warmup)
+            src << "repeat (" << warmup << ") {\n" << serve << "}\n";
+        src << "t0 = rdtscp();\n";
+        src << "repeat (" << rounds << ") {\n" << serve << "}\n";
+        src << "t1 = rdtscp();\n";
+        src << "||\n";
+
+        src << "|| pong\n";
+        src << "pin(" << pong << ");\n";
+        src << "let v = 1;\n";
+        src << "repeat (" << warmup + rounds << ") {\n";
+        src << "    await(ball[0], v);\n";
+        src << "    ball[0] = v + 1;\n";
+        src << "    v = v + 2;\n";
+        src << "}\n||\n";
+        src << "start_workers();\n";
+        return src.str();
+    }
+
+private:
+    static std::vector<size_t> allowed_cpus()
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        std::vector<size_t> cpus;
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            return cpus;
+        for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        return cpus;
+    }
+
+    // pin() can't report a failed sched_setaffinity, so catch bad CPUs up front
+    static void check_allowed(const std::vector<size_t> &cpus)
+    {
+        const std::vector<size_t> allowed = allowed_cpus();
+        for (size_t cpu : cpus)
+        {
+            if (std::find(allowed.begin(), allowed.end(), cpu) == allowed.end())
+            {
+                std::cerr << "CPU " << cpu << " is not available to this process" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    std::optional<double> round_trip_cycles(size_t ping, size_t pong) const
+    {
+        // ping and pong never share code lines, and neither do their loops
+        const CodeLayout layout{.worker_align = 64, .loop_align = 64};
+        JitImage image(compile_to_asm(emit(ping, pong, m_config.warmup, m_config.rounds), ReportFormat::text, nullptr,
+                                      layout));
+        image.run();
+
+        const auto *ball = static_cast<const int64_t*>(image.symbol("ball"));
+        if (ball[0] != static_cast<int64_t>(2 * (m_config.warmup + m_config.rounds)))
+        {
+            std::cerr << "ball ended at " << ball[0] << " for CPUs " << ping << " and " << pong << std::endl;
+            return {};
+        }
+        const auto t0 = *static_cast<const uint64_t*>(image.symbol("t0"));
+        const auto t1 = *static_cast<const uint64_t*>(image.symbol("t1"));
+        return static_cast<double>(t1 - t0) / static_cast<double>(m_config.rounds);
+    }
+
+    LatencyConfig m_config;
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct LayoutSymbol
+{
+    std::string name;
+    uint64_t address;
+};
+
+// where the generated code ended up, either in a JIT image or in a linked binary.
+// functions are the labels the generator closes with `hy_end_<name>` (main,
+// workers, hy_spawn), loop heads are its `hy_repeat_<n>` labels. for each one
+// it shows the address, the largest power of two the address is aligned to, and
+// which 64 byte lines and 4 KiB pages it covers, and it calls out functions
+// that share a cache line, since their fetches then interfere
+class CodeLayoutReport
+{
+public:
+    static void print(std::vector<LayoutSymbol> symbols, std::ostream &out)
+    {
+        using namespace std;
+        sort(symbols.begin(), symbols.end(),
+             [](const LayoutSymbol &a, const LayoutSymbol &b) { return a.address < b.address; });
+
+        vector<Function> functions;
+        for (const LayoutSymbol &sym : symbols)
+        {
+            const auto end = find_if(symbols.begin(), symbols.end(),
+                                     [&sym](const LayoutSymbol &e) { return e.name == end_prefix + sym.name; });
+            if (end != symbols.end())
+                functions.push_back({.name = sym.name, .begin = sym.address, .end = end->address});
+        }
+
+        const ios::fmtflags flags = out.flags();
+        out << "code layout (" << line_size << " byte lines, " << page_size << " byte pages)\n";
+        out << left << setw(24) << "symbol" << right << setw(20) << "address" << setw(8) << "size"
+            << setw(10) << "align" << setw(8) << "lines" << setw(8) << "pages" << "\n";
+        for (const Function &fn : functions)
+        {
+            const uint64_t last = max(fn.end, fn.begin + 1) - 1;
+            row(out, fn.name, fn.begin);
+            out << setw(8) << fn.end - fn.begin << setw(10) << alignment(fn.begin)
+                << setw(8) << last / line_size - fn.begin / line_size + 1
+                << setw(8) << last / page_size - fn.begin / page_size + 1 << "\n";
+            for (const LayoutSymbol &sym : symbols)
+            {
+                if (sym.name.rfind(loop_prefix, 0) != 0 || sym.address < fn.begin || sym.address >= fn.end)
+                    continue;
+                row(out, "  " + sym.name, sym.address);
+                out << setw(8) << "loop" << setw(10) << alignment(sym.address) << "\n";
+            }
+        }
+
+        for (size_t i = 0; i + 1 < functions.size(); i++)
+        {
+            const Function &a = functions.at(i);
+            const Function &b = functions.at(i + 1);
+            if (a.end > a.begin && (a.end - 1) / line_size == b.begin / line_size)
+                out << "note: " << a.name << " and " << b.name << " share cache line 0x"
+                    << hex << b.begin / line_size * line_size << dec << "\n";
+        }
+        out.flags(flags);
+        out.flush();
+    }
+
+    // text symbols of a linked binary, as listed by nm
+    static std::optional<std::vector<LayoutSymbol>> from_binary(const std::string &bin_path)
+    {
+        const std::string cmd = "nm -n --defined-only " + bin_path + " 2>/dev/null";
+        FILE *pipe = popen(cmd.c_str(), "r");
+        if (!pipe)
+            return {};
+        std::string listing;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), pipe)) > 0)
+            listing.append(buf, n);
+        if (pclose(pipe) != 0)
+            return {};
+
+        std::vector<LayoutSymbol> symbols;
+        std::stringstream lines(listing);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            std::stringstream fields(line);
+            std::string address, type, name;
+            if (!(fields >> address >> type >> name) || (type != "t" && type != "T"))
+                continue;
+            symbols.push_back({.name = name, .address = std::stoull(address, nullptr, 16)});
+        }
+        return symbols;
+    }
+
+private:
+    struct Function
+    {
+        std::string name;
+        uint64_t begin;
+        uint64_t end;
+    };
+
+    static constexpr uint64_t line_size = 64;
+    static constexpr uint64_t page_size = 4096;
+    // past a huge page the exact alignment stops mattering
+    static constexpr uint64_t max_alignment = 2 * 1024 * 1024;
+    static constexpr const char *end_prefix = "hy_end_";
+    static constexpr const char *loop_prefix = "hy_repeat_";
+
+    static uint64_t alignment(uint64_t address)
+    {
+        uint64_t align = 1;
+        while (align < max_alignment && address % (align * 2) == 0)
+            align *= 2;
+        return align;
+    }
+
+    static void row(std::ostream &out, const std::string &name, uint64_t address)
+    {
+        out << std::left << std::setw(24) << name << std::right << "  0x" << std::hex << std::setw(16)
+            << std::setfill('0') << address << std::setfill(' ') << std::dec;
+    }
+};
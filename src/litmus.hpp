@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+
+#include "./simulator.hpp"
+#include "./toolchain.hpp"
+
+// one memory access inside a generated worker
+struct LitmusOp
+{
+    bool is_store;
+    size_t loc;
+    // value written by a store (unique per store so every read is traceable)
+    int64_t value;
+    // `ld<dst>` global a load lands in (not `r<n>`, r8-r15 would read as registers)
+    size_t dst = 0;
+};
+
+struct LitmusTest
+{
+    uint64_t seed;
+    size_t locations;
+    std::vector<std::vector<LitmusOp>> threads = {};
+    // one `ld<n>` global per load
+    size_t regs = 0;
+};
+
+// outcome of a run: every register, then the final value of every location
+using LitmusOutcome = TsoOutcome;
+
+class LitmusGenerator
+{
+public:
+    LitmusGenerator(size_t max_workers, size_t max_ops, size_t max_locations)
+        : m_max_workers(std::max<size_t>(max_workers, 2)),
+          m_max_ops(std::max<size_t>(max_ops, 1)),
+          m_max_locations(std::max<size_t>(max_locations, 1)) {}
+
+    [[nodiscard]] LitmusTest generate(uint64_t seed) const
+    {
+        std::mt19937_64 rng(seed);
+        auto pick = [&rng](size_t lo, size_t hi) {
+            return std::uniform_int_distribution<size_t>(lo, hi)(rng);
+        };
+
+        LitmusTest test{.seed = seed, .locations = pick(1, m_max_locations)};
+        test.threads.resize(pick(2, m_max_workers));
+
+        int64_t next_value = 1;
+        for (auto &thread : test.threads)
+        {
+            const size_t ops = pick(1, m_max_ops);
+            for (size_t i = 0; i < ops; i++)
+            {
+                const bool is_store = pick(0, 1) == 0;
+                thread.push_back({.is_store = is_store, .loc = pick(0, test.locations - 1),
+                                  .value = is_store ? next_value++ : 0});
+            }
+        }
+
+        for (auto &thread : test.threads)
+            for (auto &op : thread)
+                if (!op.is_store)
+                    op.dst = test.regs++;
+
+        return test;
+    }
+
+    // lowers a test into `.hy` source in the same shape as test.hy
+    [[nodiscard]] static std::string emit(const LitmusTest &test)
+    {
+        std::stringstream out;
+        for (size_t i = 0; i < test.locations; i++)
+            out << "global let x" << i << " = 0;\n";
+        for (size_t i = 0; i < test.regs; i++)
+            out << "global let ld" << i << " = 0;\n";
+
+        for (size_t t = 0; t < test.threads.size(); t++)
+        {
+            out << "\n|| worker_" << t + 1 << "\n";
+            for (const LitmusOp &op : test.threads.at(t))
+            {
+                if (op.is_store)
+                    out << "x" << op.loc << " = " << op.value << ";\n";
+                else
+                    out << "ld" << op.dst << " = x" << op.loc << ";\n";
+            }
+            out << "||\n";
+        }
+
+        out << "\nstart_workers();\n\nreport(";
+        for (size_t i = 0; i < test.regs; i++)
+            out << "ld" << i << ", ";
+        for (size_t i = 0; i < test.locations; i++)
+            out << (i ? ", x" : "x") << i;
+        out << ");\n\nexit(0);\n";
+        return out.str();
+    }
+
+private:
+    size_t m_max_workers;
+    size_t m_max_ops;
+    size_t m_max_locations;
+};
+
+struct LitmusCampaignConfig
+{
+    uint64_t seed = 1;
+    size_t tests = 100;
+    size_t samples = 1000;
+    size_t max_workers = 4;
+    size_t max_ops = 4;
+    size_t max_locations = 2;
+    size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+};
+
+// generates, compiles and runs random litmus tests on every core, flagging any
+// observed outcome the TsoSimulator says x86-TSO forbids for that program
+class LitmusCampaign
+{
+public:
+    explicit LitmusCampaign(LitmusCampaignConfig config)
+        : m_config(config),
+          m_generator(config.max_workers, config.max_ops, config.max_locations) {}
+
+    // returns the number of tests that produced a forbidden outcome
+    size_t run()
+    {
+        using namespace std;
+        const auto begin = chrono::steady_clock::now();
+
+        vector<thread> jobs;
+        for (size_t j = 0; j < m_config.jobs; j++)
+            jobs.emplace_back([this, j] { run_job(j); });
+        for (auto &job : jobs)
+            job.join();
+
+        const double secs = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        const size_t done = m_done.load();
+        cout << "tests: " << done
+             << ", samples: " << m_samples.load()
+             << ", forbidden: " << m_forbidden.load()
+             << ", failed: " << m_failed.load() << "\n";
+        cout << "elapsed: " << secs << "s, throughput: "
+             << (secs > 0 ? static_cast<double>(done) / secs * 3600.0 : 0.0) << " tests/hour" << endl;
+        return m_forbidden.load();
+    }
+
+private:
+    // splitmix64 so neighbouring test indices still get unrelated seeds
+    static uint64_t mix_seed(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // one run prints a single csv line of reported values
+    static std::optional<LitmusOutcome> parse_outcome(const std::string &output)
+    {
+        LitmusOutcome outcome;
+        std::stringstream values(output);
+        std::string value;
+        try
+        {
+            while (std::getline(values, value, ','))
+                outcome.push_back(std::stoll(value));
+        }
+        catch (const std::exception &)
+        {
+            return {};
+        }
+        if (outcome.empty())
+            return {};
+        return outcome;
+    }
+
+    void run_job(size_t job)
+    {
+        using namespace std;
+        char dir_template[] = "/tmp/hydro-litmus-XXXXXX";
+        if (!mkdtemp(dir_template))
+        {
+            lock_guard lock(m_report_mutex);
+            cerr << "litmus job " << job << " could not create a work directory" << endl;
+            return;
+        }
+        const string dir = dir_template;
+        const string asm_path = dir + "/out.asm";
+        const string obj_path = dir + "/out.o";
+        const string bin_path = dir + "/out";
+
+        size_t index;
+        while ((index = m_next.fetch_add(1)) < m_config.tests)
+        {
+            const LitmusTest test = m_generator.generate(mix_seed(m_config.seed + index));
+            const string source = LitmusGenerator::emit(test);
+
+            // the allowed set comes from the same AST the binary was generated from
+            Parser parser(Tokenizer(source).tokenize());
+            optional<NodeProg> prog = parser.parse_prog();
+            {
+                Generator generator(prog.value(), ReportFormat::csv);
+                fstream file(asm_path, ios::out);
+                file << generator.gen_prog();
+            }
+            if (!assemble_and_link(asm_path, obj_path, bin_path))
+            {
+                m_failed++;
+                continue;
+            }
+
+            const set<LitmusOutcome> allowed = TsoSimulator(prog.value()).run_reported();
+            map<LitmusOutcome, size_t> forbidden;
+            // only runs that actually happened count, a failed run ends the test early
+            size_t ran = 0;
+            for (size_t s = 0; s < m_config.samples; s++)
+            {
+                optional<string> output = run_capture(bin_path);
+                ran++;
+                optional<LitmusOutcome> outcome = output ? parse_outcome(output.value()) : nullopt;
+                if (!outcome.has_value())
+                {
+                    m_failed++;
+                    break;
+                }
+                if (!allowed.contains(outcome.value()))
+                    forbidden[outcome.value()]++;
+            }
+            m_samples += ran;
+            m_done++;
+
+            if (!forbidden.empty())
+            {
+                m_forbidden++;
+                lock_guard lock(m_report_mutex);
+                // test i of a campaign is test 0 of one seeded with seed + i
+                cout << "FORBIDDEN outcome(s) in test " << index << " of seed " << m_config.seed
+                     << ", replay with: hydro --litmus --seed " << m_config.seed + index << " --tests 1"
+                     << " --workers " << m_config.max_workers << " --ops " << m_config.max_ops
+                     << " --locations " << m_config.max_locations << ":\n";
+                for (const auto &[outcome, count] : forbidden)
+                {
+                    cout << "    ";
+                    for (size_t i = 0; i < outcome.size(); i++)
+                        cout << (i ? "," : "") << outcome.at(i);
+                    cout << " seen " << count << " time(s)\n";
+                }
+                cout << source << endl;
+            }
+        }
+
+        unlink(asm_path.c_str());
+        unlink(obj_path.c_str());
+        unlink(bin_path.c_str());
+        rmdir(dir.c_str());
+    }
+
+    LitmusCampaignConfig m_config;
+    LitmusGenerator m_generator;
+    std::atomic<size_t> m_next = 0;
+    std::atomic<size_t> m_done = 0;
+    std::atomic<size_t> m_samples = 0;
+    std::atomic<size_t> m_forbidden = 0;
+    std::atomic<size_t> m_failed = 0;
+    std::mutex m_report_mutex;
+};
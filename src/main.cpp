@@ -4,47 +4,381 @@
 #include <optional>
 #include <vector>
 
-#include "./generation.hpp"
+#include "./contention.hpp"
+#include "./jit.hpp"
+#include "./latency.hpp"
+#include "./litmus.hpp"
+#include "./sampler.hpp"
 
-// main will consume characters from test.hy to create tokens
-int main(int argc, char* argv[]) {
+static void usage()
+{
     using namespace std;
-    if (argc != 2)
+    cerr << "Incorrect usage. Correct usage is..." << endl;
+    cerr << "hydro [--run] [--format text|csv|json] [--time-passes[=json]] [layout options] <input.hy>" << endl;
+    cerr << "hydro --sample N [--jobs J] [--format text|csv|json] [--time-passes[=json]] [layout options] <input.hy>"
+         << endl;
+    cerr << "  layout options: [--align-workers N] [--align-loops N] [--worker-sections] [--huge-pages] [--layout]"
+         << endl;
+    cerr << "hydro --litmus [--seed N] [--tests N] [--samples N] [--workers N] "
+            "[--ops N] [--locations N] [--jobs N]" << endl;
+    cerr << "hydro --simulate <input.hy> [--jobs N] [--max-states N]" << endl;
+    cerr << "hydro --contention [--threads N] [--ops N]" << endl;
+    cerr << "hydro --latency [--rounds N] [--warmup N] [--cpus a,b,...]" << endl;
+}
+
+static size_t parse_count(const char *arg)
+{
+    try
     {
-        cerr << "Incorrect usage. Correct usage is..." << endl;
-        cerr << "hydro <input.hy>" << endl;
-        return EXIT_FAILURE;
+        return std::stoull(arg);
     }
+    catch (const std::exception &)
+    {
+        std::cerr << "Expected a number, got `" << arg << "`" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
 
-    string contents;
+// random litmus campaign, every option takes one numeric value
+static int run_litmus(int argc, char* argv[])
+{
+    using namespace std;
+    LitmusCampaignConfig config;
+    for (int i = 2; i < argc; i += 2)
     {
-        stringstream contents_stream;
-        fstream input(argv[1], ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+        const string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        const size_t value = parse_count(argv[i + 1]);
+        if (flag == "--seed")
+            config.seed = value;
+        else if (flag == "--tests")
+            config.tests = value;
+        else if (flag == "--samples")
+            config.samples = value;
+        else if (flag == "--workers")
+            config.max_workers = value;
+        else if (flag == "--ops")
+            config.max_ops = value;
+        else if (flag == "--locations")
+            config.max_locations = value;
+        else if (flag == "--jobs")
+            config.jobs = max<size_t>(value, 1);
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
     }
 
-    Tokenizer tokenizer(move(contents));
-    vector<Token> tokens = tokenizer.tokenize();
-    Parser parser(move(tokens));
-    optional<NodeProg> prog = parser.parse_prog();
+    LitmusCampaign campaign(config);
+    return campaign.run() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// atomic primitive throughput under growing contention, numeric options only
+static int run_contention(int argc, char* argv[])
+{
+    using namespace std;
+    ContentionConfig config;
+    for (int i = 2; i < argc; i += 2)
+    {
+        const string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        const size_t value = max<size_t>(parse_count(argv[i + 1]), 1);
+        if (flag == "--threads")
+            config.max_threads = value;
+        else if (flag == "--ops")
+            config.ops = value;
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    ContentionBench bench(config);
+    return bench.run() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// core-to-core latency matrix, --cpus takes a comma separated list
+static int run_latency(int argc, char* argv[])
+{
+    using namespace std;
+    LatencyConfig config;
+    for (int i = 2; i < argc; i += 2)
+    {
+        const string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        if (flag == "--cpus")
+        {
+            stringstream list(argv[i + 1]);
+            string cpu;
+            while (getline(list, cpu, ','))
+                config.cpus.push_back(parse_count(cpu.c_str()));
+            continue;
+        }
+        const size_t value = parse_count(argv[i + 1]);
+        if (flag == "--rounds")
+            config.rounds = max<size_t>(value, 1);
+        else if (flag == "--warmup")
+            config.warmup = value;
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    LatencyProbe probe(config);
+    return probe.run() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
+static std::string read_file(const char *path)
+{
+    using namespace std;
+    stringstream contents_stream;
+    fstream input(path, ios::in);
+    contents_stream << input.rdbuf();
+    return contents_stream.str();
+}
+
+// prints every reported result x86-TSO allows for the program, or every final
+// state of the globals when it reports nothing
+static int run_simulate(int argc, char* argv[])
+{
+    using namespace std;
+    if (argc < 3)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+    size_t jobs = max(1u, thread::hardware_concurrency());
+    size_t max_states = TsoSimulator::default_max_states;
+    for (int i = 3; i < argc; i += 2)
+    {
+        const string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        if (flag == "--jobs")
+            jobs = max<size_t>(parse_count(argv[i + 1]), 1);
+        else if (flag == "--max-states")
+            max_states = parse_count(argv[i + 1]);
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    Parser parser(Tokenizer(read_file(argv[2])).tokenize());
+    optional<NodeProg> prog = parser.parse_prog();
     if (!prog.has_value())
     {
         cerr << "Invalid Program" << endl;
+        return EXIT_FAILURE;
+    }
+
+    const auto begin = chrono::steady_clock::now();
+    TsoSimulator simulator(prog.value(), max_states);
+    vector<string> labels = simulator.reported_labels();
+    set<TsoOutcome> outcomes;
+    if (labels.empty())
+    {
+        labels = simulator.globals();
+        outcomes = simulator.run(labels, jobs);
+    }
+    else
+        outcomes = simulator.run_reported(jobs);
+    const double secs = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    // one row per report the program printed, outcomes apart by a blank line
+    // when that takes more than one row
+    vector<vector<string>> rows = simulator.reported_rows();
+    if (rows.empty())
+        rows.push_back(labels);
+    for (const TsoOutcome &outcome : outcomes)
+    {
+        size_t value = 0;
+        for (size_t r = 0; r < rows.size() && value < outcome.size(); r++)
+        {
+            for (size_t i = 0; i < rows.at(r).size(); i++, value++)
+                cout << (i ? ", " : "") << rows.at(r).at(i) << ": " << outcome.at(value);
+            cout << "\n";
+        }
+        if (outcome.empty())
+            cout << "(no output)\n";
+        if (rows.size() > 1)
+            cout << "\n";
+    }
+    cout << outcomes.size() << " allowed outcome(s), "
+         << simulator.states_visited() << " states visited in " << secs << "s" << endl;
+    if (simulator.deadlocks())
+        cout << simulator.deadlocks() << " state(s) where a worker waits forever in await" << endl;
+    return EXIT_SUCCESS;
+}
+
+// code alignment has to be a power of two no bigger than a page
+static size_t parse_alignment(const char *arg)
+{
+    const size_t align = parse_count(arg);
+    if (align == 0 || (align & (align - 1)) != 0 || align > 4096)
+    {
+        std::cerr << "Expected a power of two up to 4096 for code alignment, got `" << arg << "`" << std::endl;
         exit(EXIT_FAILURE);
     }
+    return align;
+}
+
+static ReportFormat parse_format(const std::string &name)
+{
+    if (name == "text")
+        return ReportFormat::text;
+    if (name == "csv")
+        return ReportFormat::csv;
+    if (name == "json")
+        return ReportFormat::json;
+    std::cerr << "Unknown report format `" << name << "`, expected text, csv or json" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+// main will consume characters from test.hy to create tokens
+int main(int argc, char* argv[]) {
+    using namespace std;
+    if (argc >= 2 && string(argv[1]) == "--litmus")
+        return run_litmus(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--simulate")
+        return run_simulate(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--contention")
+        return run_contention(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--latency")
+        return run_latency(argc, argv);
+
+    // plain compile, or --run to compile straight into executable memory and run
+    // it on this process's own pthreads without touching disk
+    bool jit = false;
+    // --sample N runs the JIT image N times as a fork server, J at once
+    size_t samples = 0;
+    size_t sample_jobs = max(1u, thread::hardware_concurrency());
+    bool jobs_given = false;
+    // --time-passes prints per-phase timings and sizes to stderr
+    bool time_passes = false;
+    bool time_passes_json = false;
+    optional<ReportFormat> format;
+    // where worker code goes, and --layout to print where it ended up
+    CodeLayout layout;
+    bool print_layout = false;
+    const char *input = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        const string arg = argv[i];
+        if (arg == "--run")
+            jit = true;
+        else if (arg == "--time-passes" || arg == "--time-passes=json")
+        {
+            time_passes = true;
+            time_passes_json = arg == "--time-passes=json";
+        }
+        else if (arg == "--sample" && i + 1 < argc)
+            samples = max<size_t>(parse_count(argv[++i]), 1);
+        else if (arg == "--jobs" && i + 1 < argc)
+        {
+            sample_jobs = max<size_t>(parse_count(argv[++i]), 1);
+            jobs_given = true;
+        }
+        else if (arg == "--format" && i + 1 < argc)
+            format = parse_format(argv[++i]);
+        else if (arg == "--align-workers" && i + 1 < argc)
+            layout.worker_align = parse_alignment(argv[++i]);
+        else if (arg == "--align-loops" && i + 1 < argc)
+            layout.loop_align = parse_alignment(argv[++i]);
+        else if (arg == "--worker-sections")
+            layout.worker_sections = true;
+        else if (arg == "--huge-pages")
+            layout.huge_pages = true;
+        else if (arg == "--layout")
+            print_layout = true;
+        else if (!input && arg.rfind("--", 0) != 0)
+            input = argv[i];
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    // --jobs only means something to the fork server, which already runs the
+    // image itself and can't be combined with a single --run
+    if (!input || (jobs_given && !samples) || (samples && jit))
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
 
-    Generator generator(prog.value());
+    PassTimer timer;
+    PassTimer *passes = time_passes ? &timer : nullptr;
+
+    string src;
+    timer.time("read", [&] { src = read_file(input); });
+    timer.count("source_bytes", src.size());
+    // sampled outcomes are histogram keys, one csv line per report keeps them short
+    const ReportFormat report_format = format.value_or(samples ? ReportFormat::csv : ReportFormat::text);
+    const string asm_src = compile_to_asm(move(src), report_format, passes, layout);
+    if (samples)
     {
-        fstream file("out.asm", ios::out);
-        file << generator.gen_prog();
+        optional<JitImage> image;
+        timer.time("jit", [&] { image.emplace(asm_src, layout.huge_pages); });
+        if (print_layout)
+            CodeLayoutReport::print(image->text_symbols(), cerr);
+        ForkServer server(image.value());
+        map<string, size_t> histogram;
+        timer.time("sample", [&] { histogram = server.sample(samples, sample_jobs); });
+        if (time_passes)
+            timer.report(cerr, time_passes_json);
+        ForkServer::print(histogram, samples, timer.last_wall_ms() / 1000.0);
+        return EXIT_SUCCESS;
     }
+    if (jit)
+    {
+        optional<JitImage> image;
+        timer.time("jit", [&] { image.emplace(asm_src, layout.huge_pages); });
+        // the program may exit() straight out of hydro, report before running it
+        if (time_passes)
+            timer.report(cerr, time_passes_json);
+        if (print_layout)
+            CodeLayoutReport::print(image->text_symbols(), cerr);
+        return image->run();
+    }
+
+    timer.time("write", [&] {
+        fstream file("out.asm", ios::out);
+        file << asm_src;
+    });
 
     cout << "Code Generation Complete" << endl;
 
-    system("nasm -felf64 out.asm -o out.o");
-    system("gcc -no-pie -o out out.o -pthread");
+    const bool linked = assemble_and_link("out.asm", "out.o", "out", passes, layout.huge_pages);
+    if (time_passes)
+        timer.report(cerr, time_passes_json);
+    if (linked && print_layout)
+    {
+        if (optional<vector<LayoutSymbol>> symbols = CodeLayoutReport::from_binary("out"))
+            CodeLayoutReport::print(symbols.value(), cerr);
+        else
+            cerr << "could not read the symbols of `out` with nm" << endl;
+    }
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return linked ? EXIT_SUCCESS : EXIT_FAILURE;
+}
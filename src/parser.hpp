@@ -19,6 +19,33 @@ struct NodeTermIdent
 
 struct NodeExpr;
 
+// `slot[expr]`, one element of a global array
+struct NodeTermIndex
+{
+    Token ident;
+    NodeExpr* index;
+};
+
+// `tid`, the replica index of the running worker
+struct NodeTermTid{};
+
+// `rdtscp()`, the time stamp counter
+struct NodeTermRdtscp{};
+
+enum class RmwOp {add, swap, cas};
+
+// one atomic read-modify-write of a global: `x += v atomic`, `swap(x, v)` or
+// `cas(x, expected, v)`. evaluates to the old value, cas to 1 if it stored and 0 if not
+struct NodeTermRmw
+{
+    RmwOp op;
+    Token ident;
+    NodeExpr* index = nullptr;
+    NodeExpr* value;
+    // cas only
+    NodeExpr* expected = nullptr;
+};
+
 struct NodeBinExprAdd
 {
     NodeExpr* lhs;
@@ -39,7 +66,8 @@ struct NodeBinExpr
 
 struct NodeTerm
 {
-    std::variant<NodeTermIntLit*, NodeTermIdent*> var;
+    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermIndex*, NodeTermTid*, NodeTermRmw*,
+                 NodeTermRdtscp*> var;
 };
 
 struct NodeExpr
@@ -62,25 +90,67 @@ struct NodeGlobalStmtLet
 {
     Token ident;
     NodeExpr* expr;
+    // element count of `global let slot[N]`, 0 for a plain global
+    size_t length = 0;
 };
 
 struct NodeStmtAssign
 {
     Token ident;
     NodeExpr* expr;
+    // set for `slot[index] = expr;`
+    NodeExpr* index = nullptr;
 };
 
 struct NodeStmtStart{};
 
+// an atomic op whose result is not needed, `x += 1 atomic;` or `cas(l, 0, 1);`
+struct NodeStmtRmw
+{
+    NodeExpr* expr;
+};
+
+// `pin(cpu)`, moves the calling thread onto one CPU
+struct NodeStmtPin
+{
+    NodeExpr* cpu;
+};
+
+// `await(x, v)`, spins until the global reads v
+struct NodeStmtAwait
+{
+    Token ident;
+    NodeExpr* index = nullptr;
+    NodeExpr* value;
+};
+
+struct NodeStmt;
+
+// `repeat (N) { ... }`, runs the body N times
+struct NodeStmtRepeat
+{
+    size_t count;
+    std::vector<NodeStmt*> body;
+};
+
+// `report(x, y, ...)`, `print(x)` is the one value case
+struct NodeStmtReport
+{
+    std::vector<NodeExpr*> exprs;
+};
+
 struct NodeStmt
 {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeGlobalStmtLet*, NodeStmtAssign*,NodeStmtStart*> var;
+    std::variant<NodeStmtExit*, NodeStmtLet*, NodeGlobalStmtLet*, NodeStmtAssign*,NodeStmtStart*,
+                 NodeStmtReport*, NodeStmtRmw*, NodeStmtRepeat*, NodeStmtPin*, NodeStmtAwait*> var;
 };
 
 struct NodeWorker
 {
     Token ident;
     std::vector<NodeStmt*> body;
+    // `|| name[N]` runs N copies of the body, each with its own `tid`
+    size_t replicas = 1;
 };
 
 struct NodeProg
@@ -89,6 +159,37 @@ struct NodeProg
     std::vector<NodeWorker*> workers;
 };
 
+// renders an expression back into source form, used to label reported values
+inline std::string expr_to_string(const NodeExpr *expr)
+{
+    if (auto term = std::get_if<NodeTerm*>(&expr->var))
+    {
+        if (auto int_lit = std::get_if<NodeTermIntLit*>(&(*term)->var))
+            return (*int_lit)->int_lit.value.value();
+        if (auto index = std::get_if<NodeTermIndex*>(&(*term)->var))
+            return (*index)->ident.value.value() + "[" + expr_to_string((*index)->index) + "]";
+        if (std::holds_alternative<NodeTermTid*>((*term)->var))
+            return "tid";
+        if (std::holds_alternative<NodeTermRdtscp*>((*term)->var))
+            return "rdtscp()";
+        if (auto rmw = std::get_if<NodeTermRmw*>(&(*term)->var))
+        {
+            const NodeTermRmw *r = *rmw;
+            std::string target = r->ident.value.value();
+            if (r->index)
+                target += "[" + expr_to_string(r->index) + "]";
+            if (r->op == RmwOp::add)
+                return "(" + target + " += " + expr_to_string(r->value) + " atomic)";
+            if (r->op == RmwOp::swap)
+                return "swap(" + target + ", " + expr_to_string(r->value) + ")";
+            return "cas(" + target + ", " + expr_to_string(r->expected) + ", " + expr_to_string(r->value) + ")";
+        }
+        return std::get<NodeTermIdent*>((*term)->var)->ident.value.value();
+    }
+    const NodeBinExpr *bin_expr = std::get<NodeBinExpr*>(expr->var);
+    return expr_to_string(bin_expr->add->lhs) + " + " + expr_to_string(bin_expr->add->rhs);
+}
+
 class Parser
 {
 public:
@@ -96,6 +197,12 @@ public:
         : m_tokens(std::move(tokens)),
           m_allocator(1024 * 1024 * 4){}
 
+    // the AST lives here, its counters feed --time-passes
+    [[nodiscard]] const ArenaAllocator &allocator() const
+    {
+        return m_allocator;
+    }
+
 
     std::optional<NodeTerm*> parse_term()
      {
@@ -107,6 +214,54 @@ public:
              term->var = term_int_lit;
              return term;
          }
+         else if (peek().has_value() && peek().value().type == TokenType::ident &&
+                  peek(1).has_value() && peek(1).value().type == TokenType::open_bracket)
+         {
+             auto term_index = m_allocator.alloc<NodeTermIndex>();
+             term_index->ident = consume();
+             term_index->index = parse_index();
+             auto term = m_allocator.alloc<NodeTerm>();
+             term->var = term_index;
+             return term;
+         }
+         else if (peek().has_value() &&
+                  (peek().value().type == TokenType::cas || peek().value().type == TokenType::swap))
+         {
+             // cas(target, expected, new) / swap(target, new)
+             auto term_rmw = m_allocator.alloc<NodeTermRmw>();
+             term_rmw->op = consume().type == TokenType::cas ? RmwOp::cas : RmwOp::swap;
+             try_consume(TokenType::open_paren, "Expected `(`");
+             term_rmw->ident = try_consume(TokenType::ident, "Expected a global to operate on");
+             if (peek().has_value() && peek().value().type == TokenType::open_bracket)
+                 term_rmw->index = parse_index();
+             try_consume(TokenType::comma, "Expected `,`");
+             if (term_rmw->op == RmwOp::cas)
+             {
+                 term_rmw->expected = parse_operand();
+                 try_consume(TokenType::comma, "Expected `,`");
+             }
+             term_rmw->value = parse_operand();
+             try_consume(TokenType::close_paren, "Expected `)`");
+             auto term = m_allocator.alloc<NodeTerm>();
+             term->var = term_rmw;
+             return term;
+         }
+         else if (peek().has_value() && peek().value().type == TokenType::rdtscp)
+         {
+             consume();
+             try_consume(TokenType::open_paren, "Expected `(`");
+             try_consume(TokenType::close_paren, "Expected `)`");
+             auto term = m_allocator.alloc<NodeTerm>();
+             term->var = m_allocator.alloc<NodeTermRdtscp>();
+             return term;
+         }
+         else if (peek().has_value() && peek().value().type == TokenType::tid)
+         {
+             consume();
+             auto term = m_allocator.alloc<NodeTerm>();
+             term->var = m_allocator.alloc<NodeTermTid>();
+             return term;
+         }
          else if (peek().has_value() && peek().value().type == TokenType::ident)
          {
              auto term_ident = m_allocator.alloc<NodeTermIdent>();
@@ -179,13 +334,17 @@ public:
          if (peek().value().type == TokenType::global &&
                 peek(1).has_value() && peek(1).value().type == TokenType::let &&
                 peek(2).has_value() && peek(2).value().type == TokenType::ident &&
-                peek(3).has_value() && peek(3).value().type == TokenType::eq)
+                peek(3).has_value() &&
+                (peek(3).value().type == TokenType::eq || peek(3).value().type == TokenType::open_bracket))
          {
              consume();
              consume();
              auto global_stmt_let = m_allocator.alloc<NodeGlobalStmtLet>();
              global_stmt_let->ident = consume();
-             consume();
+             // `global let slot[N] = expr;` gives every element the same initial value
+             if (peek().value().type == TokenType::open_bracket)
+                 global_stmt_let->length = parse_length("Expected array length");
+             try_consume(TokenType::eq, "Expected `=`");
              if (auto expr = parse_expr())
              {
                  global_stmt_let->expr = expr.value();
@@ -224,11 +383,17 @@ public:
             return stmt;
         }
          if(peek().value().type == TokenType::ident &&
-                peek(1).has_value() && peek(1).value().type == TokenType::eq)
+                peek(1).has_value() &&
+                (peek(1).value().type == TokenType::eq || peek(1).value().type == TokenType::open_bracket ||
+                 peek(1).value().type == TokenType::plus_eq))
          {
              auto stmt_assign = m_allocator.alloc<NodeStmtAssign>();
              stmt_assign->ident = consume();
-             consume();
+             if (peek().value().type == TokenType::open_bracket)
+                 stmt_assign->index = parse_index();
+             if (peek().has_value() && peek().value().type == TokenType::plus_eq)
+                 return parse_add_assign(stmt_assign);
+             try_consume(TokenType::eq, "Expected `=`");
              if (auto expr = parse_expr())
              {
                  stmt_assign->expr = expr.value();
@@ -256,6 +421,98 @@ public:
              stmt->var = stmt_start;
              return stmt;
          }
+         if (peek().value().type == TokenType::cas || peek().value().type == TokenType::swap)
+         {
+             auto stmt_rmw = m_allocator.alloc<NodeStmtRmw>();
+             stmt_rmw->expr = parse_operand();
+             try_consume(TokenType::semi, "Expected `;`");
+             auto stmt = m_allocator.alloc<NodeStmt>();
+             stmt->var = stmt_rmw;
+             return stmt;
+         }
+         if (peek().value().type == TokenType::pin)
+         {
+             consume();
+             try_consume(TokenType::open_paren, "Expected `(`");
+             auto stmt_pin = m_allocator.alloc<NodeStmtPin>();
+             stmt_pin->cpu = parse_operand();
+             try_consume(TokenType::close_paren, "Expected `)`");
+             try_consume(TokenType::semi, "Expected `;`");
+             auto stmt = m_allocator.alloc<NodeStmt>();
+             stmt->var = stmt_pin;
+             return stmt;
+         }
+         if (peek().value().type == TokenType::await)
+         {
+             consume();
+             try_consume(TokenType::open_paren, "Expected `(`");
+             auto stmt_await = m_allocator.alloc<NodeStmtAwait>();
+             stmt_await->ident = try_consume(TokenType::ident, "Expected a global to wait on");
+             if (peek().has_value() && peek().value().type == TokenType::open_bracket)
+                 stmt_await->index = parse_index();
+             try_consume(TokenType::comma, "Expected `,`");
+             stmt_await->value = parse_operand();
+             try_consume(TokenType::close_paren, "Expected `)`");
+             try_consume(TokenType::semi, "Expected `;`");
+             auto stmt = m_allocator.alloc<NodeStmt>();
+             stmt->var = stmt_await;
+             return stmt;
+         }
+         if (peek().value().type == TokenType::repeat)
+         {
+             consume();
+             auto stmt_repeat = m_allocator.alloc<NodeStmtRepeat>();
+             try_consume(TokenType::open_paren, "Expected `(`");
+             const Token count = try_consume(TokenType::int_lit, "Expected repeat count");
+             stmt_repeat->count = std::stoull(count.value.value());
+             if (stmt_repeat->count == 0)
+             {
+                 cerr << "Expected repeat count, got 0" << endl;
+                 exit(EXIT_FAILURE);
+             }
+             try_consume(TokenType::close_paren, "Expected `)`");
+             try_consume(TokenType::open_curly, "Expected `{`");
+             while (peek().has_value() && peek().value().type != TokenType::close_curly)
+             {
+                 if (auto body_stmt = parse_stmt())
+                     stmt_repeat->body.push_back(body_stmt.value());
+                 else
+                 {
+                     cerr << "Invalid statement in repeat body" << endl;
+                     exit(EXIT_FAILURE);
+                 }
+             }
+             try_consume(TokenType::close_curly, "Expected `}`");
+             auto stmt = m_allocator.alloc<NodeStmt>();
+             stmt->var = stmt_repeat;
+             return stmt;
+         }
+         if ((peek().value().type == TokenType::print || peek().value().type == TokenType::report) &&
+             peek(1).has_value() && peek(1).value().type == TokenType::open_paren)
+         {
+             const bool single = consume().type == TokenType::print;
+             consume();
+             auto stmt_report = m_allocator.alloc<NodeStmtReport>();
+             while (true)
+             {
+                 if (auto expr = parse_expr())
+                     stmt_report->exprs.push_back(expr.value());
+                 else
+                 {
+                     cerr << "Invalid expression in report" << endl;
+                     exit(EXIT_FAILURE);
+                 }
+                 // comma separated values, print only ever takes one
+                 if (single || !peek().has_value() || peek().value().type != TokenType::comma)
+                     break;
+                 consume();
+             }
+             try_consume(TokenType::close_paren, "Expected `)`");
+             try_consume(TokenType::semi, "Expected `;`");
+             auto stmt = m_allocator.alloc<NodeStmt>();
+             stmt->var = stmt_report;
+             return stmt;
+         }
         return {};
     }
 
@@ -267,6 +524,8 @@ public:
              consume();
              auto worker = m_allocator.alloc<NodeWorker>();
              worker->ident = consume();
+             if (peek().has_value() && peek().value().type == TokenType::open_bracket)
+                 worker->replicas = parse_length("Expected worker replica count");
              std::vector <NodeStmt*> stmts;
 
              while(peek().has_value())
@@ -320,6 +579,121 @@ public:
     }
 
 private:
+    NodeExpr* parse_operand()
+    {
+        auto expr = parse_expr();
+        if (!expr.has_value())
+        {
+            std::cerr << "Invalid expression" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return expr.value();
+    }
+
+    // swap/cas write memory and rdtscp changes every time, evaluating them
+    // twice is not the same as once
+    static bool has_side_effects(const NodeExpr *expr)
+    {
+        if (auto bin = std::get_if<NodeBinExpr*>(&expr->var))
+            return has_side_effects((*bin)->add->lhs) || has_side_effects((*bin)->add->rhs);
+        const NodeTerm *term = std::get<NodeTerm*>(expr->var);
+        if (auto index = std::get_if<NodeTermIndex*>(&term->var))
+            return has_side_effects((*index)->index);
+        return std::holds_alternative<NodeTermRmw*>(term->var) || std::holds_alternative<NodeTermRdtscp*>(term->var);
+    }
+
+    // `target += expr atomic;` is one lock xadd. without `atomic` it is plain
+    // sugar for `target = target + expr;`, a separate load and store, so the
+    // index is evaluated twice and must not have side effects
+    std::optional<NodeStmt*> parse_add_assign(NodeStmtAssign *target)
+    {
+        try_consume(TokenType::plus_eq, "Expected `+=`");
+        NodeExpr *value = parse_operand();
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        const bool atomic = peek().has_value() && peek().value().type == TokenType::atomic;
+        if (!atomic && target->index && has_side_effects(target->index))
+        {
+            std::cerr << "Index of `" << target->ident.value.value() << "[...] +=` would run twice, "
+                      << "move swap/cas/rdtscp out of it with a let" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (atomic)
+        {
+            consume();
+            auto term_rmw = m_allocator.alloc<NodeTermRmw>();
+            term_rmw->op = RmwOp::add;
+            term_rmw->ident = target->ident;
+            term_rmw->index = target->index;
+            term_rmw->value = value;
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_rmw;
+            auto expr = m_allocator.alloc<NodeExpr>();
+            expr->var = term;
+            auto stmt_rmw = m_allocator.alloc<NodeStmtRmw>();
+            stmt_rmw->expr = expr;
+            stmt->var = stmt_rmw;
+        }
+        else
+        {
+            auto current = m_allocator.alloc<NodeTerm>();
+            if (target->index)
+            {
+                auto term_index = m_allocator.alloc<NodeTermIndex>();
+                term_index->ident = target->ident;
+                term_index->index = target->index;
+                current->var = term_index;
+            }
+            else
+            {
+                auto term_ident = m_allocator.alloc<NodeTermIdent>();
+                term_ident->ident = target->ident;
+                current->var = term_ident;
+            }
+            auto lhs = m_allocator.alloc<NodeExpr>();
+            lhs->var = current;
+            auto bin_expr_add = m_allocator.alloc<NodeBinExprAdd>();
+            bin_expr_add->lhs = lhs;
+            bin_expr_add->rhs = value;
+            auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+            bin_expr->add = bin_expr_add;
+            auto expr = m_allocator.alloc<NodeExpr>();
+            expr->var = bin_expr;
+            target->expr = expr;
+            stmt->var = target;
+        }
+        try_consume(TokenType::semi, "Expected `;`");
+        return stmt;
+    }
+
+    // `[expr]` after an array name
+    NodeExpr* parse_index()
+    {
+        try_consume(TokenType::open_bracket, "Expected `[`");
+        auto index = parse_expr();
+        if (!index.has_value())
+        {
+            std::cerr << "Invalid index expression" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        try_consume(TokenType::close_bracket, "Expected `]`");
+        return index.value();
+    }
+
+    // `[N]` with a positive integer literal
+    size_t parse_length(const std::string &err_msg)
+    {
+        try_consume(TokenType::open_bracket, "Expected `[`");
+        const Token length = try_consume(TokenType::int_lit, err_msg);
+        try_consume(TokenType::close_bracket, "Expected `]`");
+        const size_t n = std::stoull(length.value.value());
+        if (n == 0)
+        {
+            std::cerr << err_msg << ", got 0" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return n;
+    }
+
     [[nodiscard]] std::optional<Token> peek(int offset = 0) const
     {
         if (m_index + offset >= m_tokens.size())
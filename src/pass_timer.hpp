@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+
+// wall time per compiler phase plus a few size counters, for --time-passes.
+// phases that run nasm or gcc also get the CPU time their child processes used,
+// taken from getrusage(RUSAGE_CHILDREN) around the phase
+class PassTimer
+{
+public:
+    struct Pass
+    {
+        std::string name;
+        double wall_ms;
+        double child_cpu_ms;
+    };
+
+    void time(const std::string &name, const std::function<void()> &phase)
+    {
+        const double child_before = child_cpu_ms();
+        const auto begin = std::chrono::steady_clock::now();
+        phase();
+        const auto end = std::chrono::steady_clock::now();
+        m_passes.push_back(Pass{
+            .name = name,
+            .wall_ms = std::chrono::duration<double, std::milli>(end - begin).count(),
+            .child_cpu_ms = child_cpu_ms() - child_before,
+        });
+    }
+
+    [[nodiscard]] double last_wall_ms() const
+    {
+        return m_passes.empty() ? 0.0 : m_passes.back().wall_ms;
+    }
+
+    void count(const std::string &name, uint64_t value)
+    {
+        m_counters.emplace_back(name, value);
+    }
+
+    void report(std::ostream &out, bool json) const
+    {
+        double total = 0;
+        for (const Pass &pass : m_passes)
+            total += pass.wall_ms;
+
+        if (json)
+        {
+            out << "{\"passes\":[";
+            for (size_t i = 0; i < m_passes.size(); i++)
+            {
+                const Pass &pass = m_passes.at(i);
+                out << (i ? "," : "") << "{\"name\":\"" << pass.name << "\",\"wall_ms\":" << pass.wall_ms
+                    << ",\"child_cpu_ms\":" << pass.child_cpu_ms << "}";
+            }
+            out << "],\"total_ms\":" << total << ",\"counters\":{";
+            for (size_t i = 0; i < m_counters.size(); i++)
+                out << (i ? "," : "") << "\"" << m_counters.at(i).first << "\":" << m_counters.at(i).second;
+            out << "}}" << std::endl;
+            return;
+        }
+
+        const std::ios_base::fmtflags flags = out.flags();
+        const std::streamsize precision = out.precision();
+        out << "===== pass timings =====\n";
+        out << std::fixed << std::setprecision(3);
+        out << std::left << std::setw(12) << "pass" << std::right << std::setw(12) << "wall ms"
+            << std::setw(16) << "child cpu ms" << std::setw(9) << "%" << "\n";
+        for (const Pass &pass : m_passes)
+        {
+            out << std::left << std::setw(12) << pass.name << std::right << std::setw(12) << pass.wall_ms
+                << std::setw(16) << pass.child_cpu_ms
+                << std::setw(8) << std::setprecision(1) << (total > 0 ? 100 * pass.wall_ms / total : 0) << "%\n"
+                << std::setprecision(3);
+        }
+        out << std::left << std::setw(12) << "total" << std::right << std::setw(12) << total << "\n";
+        out << "===== counters =====\n";
+        for (const auto &[name, value] : m_counters)
+            out << std::left << std::setw(20) << name << std::right << std::setw(12) << value << "\n";
+        out.flags(flags);
+        out.precision(precision);
+        out.flush();
+    }
+
+private:
+    static double child_cpu_ms()
+    {
+        rusage usage {};
+        getrusage(RUSAGE_CHILDREN, &usage);
+        const auto ms = [](const timeval &tv) { return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0; };
+        return ms(usage.ru_utime) + ms(usage.ru_stime);
+    }
+
+    std::vector<Pass> m_passes;
+    std::vector<std::pair<std::string, uint64_t>> m_counters;
+};
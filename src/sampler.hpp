@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./jit.hpp"
+
+// runs a JIT-loaded program many times as a fork server. the image is
+// assembled, loaded and linked against libc once, then every sample is just a
+// fork() of this process: the child starts from the pristine image (globals
+// untouched, no exec, no dynamic linking) and writes its report into a pipe.
+// up to `jobs` children run at once and their outputs are merged into one
+// histogram keyed by the complete output of a run
+class ForkServer
+{
+public:
+    explicit ForkServer(const JitImage &image)
+        : m_image(image) {}
+
+    // outcome -> number of runs that produced it. runs that crash or exit
+    // nonzero show up as `<exit N>` / `<signal N>`
+    std::map<std::string, size_t> sample(size_t samples, size_t jobs)
+    {
+        std::map<std::string, size_t> histogram;
+        std::vector<Child> running;
+        std::vector<pollfd> fds;
+        size_t started = 0;
+        jobs = std::max<size_t>(jobs, 1);
+
+        // children inherit whatever is still sitting in our buffers
+        std::cout.flush();
+        std::cerr.flush();
+        while (started < samples || !running.empty())
+        {
+            while (started < samples && running.size() < jobs)
+            {
+                running.push_back(spawn(running));
+                started++;
+            }
+
+            fds.clear();
+            for (const Child &child : running)
+                fds.push_back(pollfd{.fd = child.fd, .events = POLLIN, .revents = 0});
+            if (poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "poll failed while sampling" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+
+            // drain whatever is ready, children at EOF are reaped and counted
+            for (size_t i = running.size(); i-- > 0;)
+            {
+                if (fds.at(i).revents == 0)
+                    continue;
+                Child &child = running.at(i);
+                char buf[4096];
+                const ssize_t n = read(child.fd, buf, sizeof(buf));
+                if (n > 0)
+                {
+                    child.output.append(buf, static_cast<size_t>(n));
+                    continue;
+                }
+                if (n < 0 && errno == EINTR)
+                    continue;
+                close(child.fd);
+                histogram[finish(child)]++;
+                running.erase(running.begin() + static_cast<std::ptrdiff_t>(i));
+            }
+        }
+        return histogram;
+    }
+
+    // count, rate and outcome per line, most frequent first
+    static void print(const std::map<std::string, size_t> &histogram, size_t samples, double secs)
+    {
+        using namespace std;
+        vector<pair<string, size_t>> rows(histogram.begin(), histogram.end());
+        stable_sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+
+        cout << right << setw(10) << "count" << setw(10) << "rate" << "  outcome\n";
+        for (const auto &[outcome, count] : rows)
+        {
+            cout << setw(10) << count << setw(9) << fixed << setprecision(3)
+                 << 100.0 * static_cast<double>(count) / static_cast<double>(max<size_t>(samples, 1)) << "%  "
+                 << outcome << "\n";
+        }
+        cout << defaultfloat << setprecision(6);
+        cout << samples << " samples, " << histogram.size() << " distinct outcome(s) in " << secs << "s ("
+             << (secs > 0 ? static_cast<double>(samples) / secs : 0.0) << " samples/s)" << endl;
+    }
+
+private:
+    struct Child
+    {
+        pid_t pid;
+        int fd;
+        std::string output;
+    };
+
+    // the child gets only its own pipe: the read ends of the children already
+    // running would otherwise stay open in every sibling (and leak into anything
+    // exec'd, hence O_CLOEXEC)
+    Child spawn(const std::vector<Child> &running) const
+    {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+        {
+            std::cerr << "pipe failed while sampling" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const pid_t pid = fork();
+        if (pid < 0)
+        {
+            std::cerr << "fork failed while sampling" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0)
+        {
+            close(pipe_fds[0]);
+            for (const Child &sibling : running)
+                close(sibling.fd);
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            close(pipe_fds[1]);
+            // programs without workers leave through their own exit syscall
+            _exit(m_image.run());
+        }
+        close(pipe_fds[1]);
+        return Child{.pid = pid, .fd = pipe_fds[0], .output = {}};
+    }
+
+    // reaps the child, a clean run's outcome is its output on one line
+    static std::string finish(const Child &child)
+    {
+        int status = 0;
+        while (waitpid(child.pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        if (WIFSIGNALED(status))
+            return "<signal " + std::to_string(WTERMSIG(status)) + ">";
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            return "<exit " + std::to_string(WEXITSTATUS(status)) + ">";
+
+        std::string outcome = child.output;
+        while (!outcome.empty() && outcome.back() == '\n')
+            outcome.pop_back();
+        std::replace(outcome.begin(), outcome.end(), '\n', ' ');
+        return outcome;
+    }
+
+    const JitImage &m_image;
+};
@@ -0,0 +1,1242 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "./parser.hpp"
+
+// observed final values, in the order they were asked for
+using TsoOutcome = std::vector<int64_t>;
+
+// exhaustive operational x86-TSO model run straight over the AST.
+// every worker owns a FIFO store buffer, stores go into it, loads forward from
+// the newest matching entry before falling back to memory, and the oldest entry
+// of any buffer may flush to memory at any time. each global read inside an
+// expression is its own step, matching the one `push QWORD [rel x]` per read
+// that the generator emits. replicated workers run as one thread per replica
+// with their own `tid`, and every element of a global array is its own location.
+// worker locals never touch memory, they are plain per-thread state. `await`
+// blocks its thread until the value it would load matches, so the search never
+// spins, and `pin` only changes which CPU runs a thread, which x86-TSO ignores.
+class TsoSimulator
+{
+public:
+    // the search gives up once it has seen `max_states` distinct states
+    explicit TsoSimulator(const NodeProg &prog, size_t max_states = default_max_states)
+        : m_prog(prog), m_max_states(max_states)
+    {
+        // globals get initialized in declaration order before any thread starts
+        for (const NodeStmt *stmt : m_prog.stmts)
+        {
+            if (auto global_let = std::get_if<NodeGlobalStmtLet*>(&stmt->var))
+            {
+                const NodeGlobalStmtLet *g = *global_let;
+                const std::string &name = g->ident.value.value();
+                if (m_globals.contains(name))
+                {
+                    std::cerr << "Duplicate global variable: " << name << "\n";
+                    std::exit(EXIT_FAILURE);
+                }
+                m_globals.insert({name, Global{.base = m_global_names.size(), .length = g->length}});
+                if (g->length == 0)
+                    m_global_names.push_back(name);
+                for (size_t i = 0; i < g->length; i++)
+                    m_global_names.push_back(name + "[" + std::to_string(i) + "]");
+            }
+        }
+        for (size_t loc = 0; loc < m_global_names.size(); loc++)
+            m_labels.insert({m_global_names.at(loc), loc});
+
+        // what main runs once every worker is joined, everything when there are no workers
+        bool started = m_prog.workers.empty();
+        for (const NodeStmt *stmt : m_prog.stmts)
+        {
+            if (std::holds_alternative<NodeStmtStart*>(stmt->var))
+                started = true;
+            else if (started && !std::holds_alternative<NodeGlobalStmtLet*>(stmt->var))
+                m_main.push_back(stmt);
+        }
+        for (const NodeStmt *stmt : m_main)
+        {
+            if (!std::holds_alternative<NodeStmtAssign*>(stmt->var) && !std::holds_alternative<NodeStmtReport*>(stmt->var)
+                && !std::holds_alternative<NodeStmtRmw*>(stmt->var) && !std::holds_alternative<NodeStmtPin*>(stmt->var)
+                && !std::holds_alternative<NodeStmtExit*>(stmt->var))
+            {
+                std::cerr << "Simulator only supports assignments, atomics, pin, report and exit after start_workers()"
+                          << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+        }
+
+        // one thread per replica, in the same slot order the generator spawns them
+        m_local_slots.resize(m_prog.workers.size());
+        for (size_t w = 0; w < m_prog.workers.size(); w++)
+        {
+            const NodeWorker *worker = m_prog.workers.at(w);
+            std::vector<Step> steps;
+            lower_block(worker->body, {}, m_local_slots.at(w), steps, worker);
+            for (size_t r = 0; r < worker->replicas; r++)
+            {
+                m_threads.push_back(steps);
+                m_tids.push_back(static_cast<int64_t>(r));
+                m_thread_worker.push_back(w);
+            }
+        }
+
+        // who touches what, for the partial-order reduction. indices that only
+        // depend on literals and `tid` pin down one element, anything else
+        // counts as touching the whole array. per thread it also keeps how far
+        // into its steps each location is still loaded, stored or atomically
+        // updated, so what a thread may touch from its pc on is one lookup
+        m_writers.resize(m_global_names.size());
+        m_accessors.resize(m_global_names.size());
+        for (size_t t = 0; t < m_threads.size(); t++)
+        {
+            Footprint footprint{.load = std::vector<size_t>(m_global_names.size(), 0),
+                                .store = std::vector<size_t>(m_global_names.size(), 0),
+                                .rmw = std::vector<size_t>(m_global_names.size(), 0)};
+            for (size_t i = 0; i < m_threads.at(t).size(); i++)
+            {
+                const Step &step = m_threads.at(t).at(i);
+                std::set<size_t> reads, writes, stores;
+                const Scope *names = step.names.get();
+                if (step.index)
+                    static_locations(step.index, t, names, reads, writes);
+                static_locations(step.expr, t, names, reads, writes);
+                if (step.dst && !step.local.has_value())
+                    static_element(*step.dst, step.index, t, names, stores);
+                if (step.await)
+                    static_element(*step.await, step.index, t, names, reads);
+                for (size_t loc : reads)
+                {
+                    m_accessors.at(loc).insert(t);
+                    footprint.load.at(loc) = i + 1;
+                }
+                for (size_t loc : writes)
+                {
+                    m_writers.at(loc).insert(t);
+                    m_accessors.at(loc).insert(t);
+                    footprint.rmw.at(loc) = i + 1;
+                }
+                for (size_t loc : stores)
+                {
+                    m_writers.at(loc).insert(t);
+                    m_accessors.at(loc).insert(t);
+                    footprint.store.at(loc) = i + 1;
+                }
+            }
+            m_footprints.push_back(std::move(footprint));
+        }
+    }
+
+    // around 160 bytes of visited set each, so about 1.6 GB
+    static constexpr size_t default_max_states = 10000000;
+
+    [[nodiscard]] const std::vector<std::string> &globals() const
+    {
+        return m_global_names;
+    }
+
+    [[nodiscard]] size_t states_visited() const
+    {
+        return m_visited_count.load();
+    }
+
+    // final states where some thread is stuck in an `await` nobody will satisfy,
+    // the real program hangs there so they produce no outcome
+    [[nodiscard]] size_t deadlocks() const
+    {
+        return m_deadlock_count.load();
+    }
+
+    // every final value of the `observed` globals x86-TSO allows, searched over `jobs` threads
+    [[nodiscard]] std::set<TsoOutcome> run(const std::vector<std::string> &observed, size_t jobs = 1)
+    {
+        std::vector<size_t> locs;
+        for (const std::string &label : observed)
+        {
+            if (!m_labels.contains(label))
+            {
+                std::cerr << "Undeclared Global Identifier:  " << label << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            locs.push_back(m_labels.at(label));
+        }
+        return search_all(jobs, [&locs](const std::vector<int64_t> &mem) {
+            TsoOutcome outcome;
+            for (size_t loc : locs)
+                outcome.push_back(mem.at(loc));
+            return outcome;
+        });
+    }
+
+    // labels of every reported value, in report order
+    [[nodiscard]] std::vector<std::string> reported_labels() const
+    {
+        std::vector<std::string> labels;
+        for (const NodeExpr *expr : reported())
+            labels.push_back(expr_to_string(expr));
+        return labels;
+    }
+
+    // the labels again, one row per report statement like the program prints them
+    [[nodiscard]] std::vector<std::vector<std::string>> reported_rows() const
+    {
+        std::vector<std::vector<std::string>> rows;
+        for (const NodeStmt *stmt : m_prog.stmts)
+        {
+            if (auto report = std::get_if<NodeStmtReport*>(&stmt->var))
+            {
+                rows.emplace_back();
+                for (const NodeExpr *expr : (*report)->exprs)
+                    rows.back().push_back(expr_to_string(expr));
+            }
+        }
+        return rows;
+    }
+
+    // every output the program may produce. main's statements after
+    // start_workers() run in order over each final memory, and the values of
+    // all reports it reaches are laid end to end. an `exit` stops main early,
+    // so an outcome can cover fewer reports than reported_rows()
+    [[nodiscard]] std::set<TsoOutcome> run_reported(size_t jobs = 1)
+    {
+        return search_all(jobs, [this](const std::vector<int64_t> &mem) {
+            std::vector<int64_t> scratch = mem;
+            return run_main(scratch);
+        });
+    }
+
+private:
+    using Projection = std::function<TsoOutcome(const std::vector<int64_t>&)>;
+
+    [[nodiscard]] std::vector<const NodeExpr*> reported() const
+    {
+        std::vector<const NodeExpr*> exprs;
+        for (const NodeStmt *stmt : m_prog.stmts)
+            if (auto report = std::get_if<NodeStmtReport*>(&stmt->var))
+                exprs.insert(exprs.end(), (*report)->exprs.begin(), (*report)->exprs.end());
+        return exprs;
+    }
+
+
+    std::set<TsoOutcome> search_all(size_t jobs, const Projection &project)
+    {
+        State init;
+        init.threads.resize(m_threads.size());
+        for (size_t t = 0; t < m_threads.size(); t++)
+            init.threads.at(t).locals.assign(m_local_slots.at(m_thread_worker.at(t)), 0);
+        init.mem.assign(m_global_names.size(), 0);
+        for (const NodeStmt *stmt : m_prog.stmts)
+        {
+            if (auto global_let = std::get_if<NodeGlobalStmtLet*>(&stmt->var))
+            {
+                const NodeGlobalStmtLet *g = *global_let;
+                const Global &global = m_globals.at(g->ident.value.value());
+                const int64_t value = eval_main(g->expr, init.mem);
+                for (size_t i = 0; i < std::max<size_t>(global.length, 1); i++)
+                    init.mem.at(global.base + i) = value;
+            }
+        }
+
+        for (size_t t = 0; t < m_threads.size(); t++)
+            run_local(init, t);
+
+        jobs = std::max<size_t>(jobs, 1);
+        m_queues = std::vector<WorkQueue>(jobs);
+        m_visited = std::vector<VisitedShard>(visited_shards);
+        m_visited_count = 0;
+        m_deadlock_count = 0;
+        m_pending = 1;
+        m_overflow = false;
+        insert_visited(init);
+        m_queues.at(0).states.push_back(std::move(init));
+
+        std::vector<std::set<TsoOutcome>> outcomes(jobs);
+        std::vector<std::thread> workers;
+        for (size_t j = 0; j < jobs; j++)
+            workers.emplace_back([this, j, &project, &outcomes] { search(j, project, outcomes.at(j)); });
+        for (auto &worker : workers)
+            worker.join();
+        if (m_overflow)
+        {
+            std::cerr << "State space too large to simulate, gave up after " << m_max_states
+                      << " states (--max-states raises the limit)" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        std::set<TsoOutcome> merged;
+        for (auto &set : outcomes)
+            merged.merge(set);
+        return merged;
+    }
+
+    struct Global
+    {
+        // first location, arrays take `length` consecutive ones
+        size_t base;
+        // 0 for scalars
+        size_t length;
+    };
+
+    // local name -> slot in ThreadState::locals
+    using Scope = std::unordered_map<std::string, size_t>;
+
+    // one assignment, `dst[index] = expr`. the generated code loads everything
+    // `index` reads first, then everything `expr` reads, then stores. `let`s
+    // and assignments to locals set a thread-local slot instead, and a
+    // statement-level atomic or a `pin` (no dst) only runs `expr` for its side
+    // effect. `await[index]` waits for that global to hold `expr` instead
+    struct Step
+    {
+        const Token *dst;
+        const NodeExpr *index;
+        const NodeExpr *expr;
+        std::optional<size_t> local = {};
+        // locals visible to this step
+        std::shared_ptr<const Scope> names;
+        const Token *await = nullptr;
+    };
+
+    struct Rmw
+    {
+        RmwOp op;
+        int64_t value;
+        int64_t expected;
+    };
+
+    // a plain load, an atomic read-modify-write when `rmw` is set, or the
+    // final load of an `await` that only goes through once it sees `await`
+    struct Access
+    {
+        size_t loc;
+        std::optional<Rmw> rmw = {};
+        std::optional<int64_t> await = {};
+    };
+
+    // hands out the results of the accesses a thread already did, in order.
+    // once they run out, the next access is left in `missing`. without
+    // `locals` (static analysis, main) a local read has no value
+    struct ReadCursor
+    {
+        const std::vector<int64_t> &reads;
+        const std::vector<int64_t> *locals = nullptr;
+        const Scope *names = nullptr;
+        size_t next = 0;
+        std::optional<Access> missing = {};
+    };
+
+    struct ThreadState
+    {
+        size_t pc = 0;
+        std::vector<int64_t> locals;
+        // values already loaded for the current step, in load order
+        std::vector<int64_t> reads;
+        // oldest entry first, rarely more than a handful so a vector beats a deque
+        std::vector<std::pair<size_t, int64_t>> buffer;
+    };
+
+    struct State
+    {
+        std::vector<int64_t> mem;
+        std::vector<ThreadState> threads;
+        // sleep set: agents (see persistent_set) whose next move a sibling
+        // branch already explored and that commutes with everything done
+        // since. bit i is agent i, agents past 63 never sleep
+        uint64_t sleep = 0;
+    };
+
+    struct VisitedShard
+    {
+        std::mutex mutex;
+        // the sleep set each state was last expanded with
+        std::unordered_map<std::string, uint64_t> keys;
+    };
+
+    // remaining accesses of one thread: for every location, one past the last
+    // step that loads (await included), stores or atomically updates it, 0 if none
+    struct Footprint
+    {
+        std::vector<size_t> load;
+        std::vector<size_t> store;
+        std::vector<size_t> rmw;
+    };
+
+    // each search thread pops from the back of its own queue and steals from the front of others
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<State> states;
+    };
+
+    static constexpr size_t visited_shards = 64;
+    // unrolled repeat loops past this are more than an exhaustive search can take
+    static constexpr size_t max_unrolled_steps = 100000;
+
+    const Global &global(const Token &ident) const
+    {
+        const std::string &name = ident.value.value();
+        if (!m_globals.contains(name))
+        {
+            std::cerr << "Undeclared Global Identifier:  " << name << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        return m_globals.at(name);
+    }
+
+    // location of `ident`, or of `ident[index]` when an index is given
+    size_t element(const Token &ident, std::optional<int64_t> index) const
+    {
+        const Global &g = global(ident);
+        if (g.length == 0 && index.has_value())
+        {
+            std::cerr << "Indexing a global that is not an array: " << ident.value.value() << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        if (g.length != 0 && !index.has_value())
+        {
+            std::cerr << "Global array used without an index: " << ident.value.value() << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        if (!index.has_value())
+            return g.base;
+        if (index.value() < 0 || static_cast<size_t>(index.value()) >= g.length)
+        {
+            std::cerr << "Index " << index.value() << " out of range for "
+                      << ident.value.value() << "[" << g.length << "]" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        return g.base + static_cast<size_t>(index.value());
+    }
+
+    // evaluates `expr` as thread `t` over the memory accesses it already did, in
+    // the order the generated code issues them. nullopt when it needs another
+    // access first, which is then left in the cursor
+    std::optional<int64_t> eval(const NodeExpr *expr, size_t t, ReadCursor &cursor) const
+    {
+        if (auto bin = std::get_if<NodeBinExpr*>(&expr->var))
+        {
+            const std::optional<int64_t> lhs = eval((*bin)->add->lhs, t, cursor);
+            if (!lhs.has_value())
+                return {};
+            const std::optional<int64_t> rhs = eval((*bin)->add->rhs, t, cursor);
+            if (!rhs.has_value())
+                return {};
+            return lhs.value() + rhs.value();
+        }
+        const NodeTerm *term = std::get<NodeTerm*>(expr->var);
+        if (auto int_lit = std::get_if<NodeTermIntLit*>(&term->var))
+            return std::stoll((*int_lit)->int_lit.value.value());
+        if (std::holds_alternative<NodeTermTid*>(term->var))
+        {
+            if (t >= m_tids.size())
+            {
+                std::cerr << "tid used outside a worker\n";
+                std::exit(EXIT_FAILURE);
+            }
+            return m_tids.at(t);
+        }
+        if (auto ident = std::get_if<NodeTermIdent*>(&term->var))
+        {
+            if (std::optional<size_t> slot = local_slot(cursor.names, (*ident)->ident))
+            {
+                if (!cursor.locals)
+                    return {};
+                return cursor.locals->at(slot.value());
+            }
+        }
+        if (auto rmw = std::get_if<NodeTermRmw*>(&term->var))
+            return eval_rmw(*rmw, t, cursor);
+        if (std::holds_alternative<NodeTermRdtscp*>(term->var))
+        {
+            std::cerr << "Simulator can't model rdtscp(), the cycle counter is not part of x86-TSO" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        size_t loc;
+        if (auto index = std::get_if<NodeTermIndex*>(&term->var))
+        {
+            const std::optional<int64_t> i = eval((*index)->index, t, cursor);
+            if (!i.has_value())
+                return {};
+            loc = element((*index)->ident, i);
+        }
+        else
+            loc = element(std::get<NodeTermIdent*>(term->var)->ident, std::nullopt);
+
+        if (cursor.next < cursor.reads.size())
+            return cursor.reads.at(cursor.next++);
+        cursor.missing = Access{.loc = loc};
+        return {};
+    }
+
+    // operands in generator order (index, expected, value), then the locked
+    // access itself, which leaves the old value in `reads` like a load
+    std::optional<int64_t> eval_rmw(const NodeTermRmw *rmw, size_t t, ReadCursor &cursor) const
+    {
+        std::optional<int64_t> index, expected;
+        if (rmw->index)
+        {
+            index = eval(rmw->index, t, cursor);
+            if (!index.has_value())
+                return {};
+        }
+        if (rmw->expected)
+        {
+            expected = eval(rmw->expected, t, cursor);
+            if (!expected.has_value())
+                return {};
+        }
+        const std::optional<int64_t> value = eval(rmw->value, t, cursor);
+        if (!value.has_value())
+            return {};
+
+        const size_t loc = element(rmw->ident, index);
+        if (cursor.next < cursor.reads.size())
+        {
+            const int64_t old = cursor.reads.at(cursor.next++);
+            if (rmw->op == RmwOp::cas)
+                return old == expected.value() ? 1 : 0;
+            return old;
+        }
+        cursor.missing = Access{.loc = loc, .rmw = Rmw{.op = rmw->op, .value = value.value(),
+                                                       .expected = expected.value_or(0)}};
+        return {};
+    }
+
+    // main after the join, alone and in program order
+    TsoOutcome run_main(std::vector<int64_t> &mem) const
+    {
+        TsoOutcome outcome;
+        for (const NodeStmt *stmt : m_main)
+        {
+            if (auto report = std::get_if<NodeStmtReport*>(&stmt->var))
+            {
+                for (const NodeExpr *expr : (*report)->exprs)
+                    outcome.push_back(eval_main(expr, mem));
+            }
+            else if (auto assign = std::get_if<NodeStmtAssign*>(&stmt->var))
+            {
+                // index first, then the value, like the generated code
+                const NodeStmtAssign *a = *assign;
+                std::optional<int64_t> index;
+                if (a->index)
+                    index = eval_main(a->index, mem);
+                const int64_t value = eval_main(a->expr, mem);
+                mem.at(element(a->ident, index)) = value;
+            }
+            else if (auto rmw = std::get_if<NodeStmtRmw*>(&stmt->var))
+                eval_main((*rmw)->expr, mem);
+            else if (auto pin = std::get_if<NodeStmtPin*>(&stmt->var))
+                eval_main((*pin)->cpu, mem);
+            else if (auto exit = std::get_if<NodeStmtExit*>(&stmt->var))
+            {
+                eval_main((*exit)->expr, mem);
+                break;
+            }
+        }
+        return outcome;
+    }
+
+    // main runs alone with every buffer drained, so it reads memory directly
+    int64_t eval_main(const NodeExpr *expr, std::vector<int64_t> &mem) const
+    {
+        std::vector<int64_t> reads;
+        while (true)
+        {
+            ReadCursor cursor{.reads = reads};
+            const std::optional<int64_t> value = eval(expr, m_tids.size(), cursor);
+            if (value.has_value())
+                return value.value();
+            reads.push_back(access(mem, cursor.missing.value()));
+        }
+    }
+
+    // value of `expr` for thread `t` when it touches no globals and no locals
+    std::optional<int64_t> static_value(const NodeExpr *expr, size_t t, const Scope *names) const
+    {
+        const std::vector<int64_t> none;
+        ReadCursor cursor{.reads = none, .names = names};
+        return eval(expr, t, cursor);
+    }
+
+    // every location `ident[index]` may name for thread `t`
+    void static_element(const Token &ident, const NodeExpr *index, size_t t, const Scope *names,
+                        std::set<size_t> &locs) const
+    {
+        if (!index)
+        {
+            locs.insert(element(ident, std::nullopt));
+            return;
+        }
+        const std::optional<int64_t> i = static_value(index, t, names);
+        if (i.has_value())
+        {
+            locs.insert(element(ident, i));
+            return;
+        }
+        const Global &g = global(ident);
+        for (size_t e = 0; e < std::max<size_t>(g.length, 1); e++)
+            locs.insert(g.base + e);
+    }
+
+    // every location evaluating `expr` may load from or, through an atomic, write to
+    void static_locations(const NodeExpr *expr, size_t t, const Scope *names,
+                          std::set<size_t> &reads, std::set<size_t> &writes) const
+    {
+        if (auto bin = std::get_if<NodeBinExpr*>(&expr->var))
+        {
+            static_locations((*bin)->add->lhs, t, names, reads, writes);
+            static_locations((*bin)->add->rhs, t, names, reads, writes);
+            return;
+        }
+        const NodeTerm *term = std::get<NodeTerm*>(expr->var);
+        if (auto ident = std::get_if<NodeTermIdent*>(&term->var))
+        {
+            if (!local_slot(names, (*ident)->ident).has_value())
+                static_element((*ident)->ident, nullptr, t, names, reads);
+        }
+        else if (auto index = std::get_if<NodeTermIndex*>(&term->var))
+        {
+            static_locations((*index)->index, t, names, reads, writes);
+            static_element((*index)->ident, (*index)->index, t, names, reads);
+        }
+        else if (auto rmw = std::get_if<NodeTermRmw*>(&term->var))
+        {
+            const NodeTermRmw *r = *rmw;
+            if (r->index)
+                static_locations(r->index, t, names, reads, writes);
+            if (r->expected)
+                static_locations(r->expected, t, names, reads, writes);
+            static_locations(r->value, t, names, reads, writes);
+            static_element(r->ident, r->index, t, names, writes);
+        }
+    }
+
+    static std::optional<size_t> local_slot(const Scope *names, const Token &ident)
+    {
+        if (!names)
+            return {};
+        const auto it = names->find(ident.value.value());
+        if (it == names->end())
+            return {};
+        return it->second;
+    }
+
+    // every identifier in `expr` has to be a local declared above it or a global,
+    // same as the generator resolves them
+    void check_names(const NodeExpr *expr, const Scope &names) const
+    {
+        if (auto bin = std::get_if<NodeBinExpr*>(&expr->var))
+        {
+            check_names((*bin)->add->lhs, names);
+            check_names((*bin)->add->rhs, names);
+            return;
+        }
+        const NodeTerm *term = std::get<NodeTerm*>(expr->var);
+        if (auto ident = std::get_if<NodeTermIdent*>(&term->var))
+        {
+            if (!names.contains((*ident)->ident.value.value()))
+                global((*ident)->ident);
+        }
+        else if (auto index = std::get_if<NodeTermIndex*>(&term->var))
+            check_names((*index)->index, names);
+        else if (auto rmw = std::get_if<NodeTermRmw*>(&term->var))
+        {
+            const NodeTermRmw *r = *rmw;
+            if (names.contains(r->ident.value.value()))
+            {
+                std::cerr << "Atomic operation on a local, only globals are shared: "
+                          << r->ident.value.value() << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            global(r->ident);
+            if (r->index)
+                check_names(r->index, names);
+            if (r->expected)
+                check_names(r->expected, names);
+            check_names(r->value, names);
+        }
+    }
+
+    // flattens a worker body into steps. repeat loops are unrolled, each step
+    // keeps the locals in scope where it was written, and `slots` ends up as the
+    // most locals ever live at once
+    void lower_block(const std::vector<NodeStmt*> &body, Scope names, size_t &slots,
+                     std::vector<Step> &steps, const NodeWorker *worker) const
+    {
+        auto scope = std::make_shared<const Scope>(names);
+        for (const NodeStmt *stmt : body)
+        {
+            if (auto assign = std::get_if<NodeStmtAssign*>(&stmt->var))
+            {
+                const NodeStmtAssign *a = *assign;
+                Step step{.dst = &a->ident, .index = a->index, .expr = a->expr, .names = scope};
+                if (a->index)
+                    check_names(a->index, names);
+                check_names(a->expr, names);
+                if (names.contains(a->ident.value.value()))
+                {
+                    if (a->index)
+                    {
+                        std::cerr << "Indexing a local that is not an array: " << a->ident.value.value() << std::endl;
+                        std::exit(EXIT_FAILURE);
+                    }
+                    step.local = names.at(a->ident.value.value());
+                }
+                steps.push_back(step);
+            }
+            else if (auto let = std::get_if<NodeStmtLet*>(&stmt->var))
+            {
+                const std::string &name = (*let)->ident.value.value();
+                if (names.contains(name) || m_globals.contains(name))
+                {
+                    std::cerr << "Identifier already used " << name << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                check_names((*let)->expr, names);
+                const size_t slot = names.size();
+                steps.push_back(Step{.dst = &(*let)->ident, .index = nullptr, .expr = (*let)->expr,
+                                     .local = slot, .names = scope});
+                names.insert({name, slot});
+                slots = std::max(slots, names.size());
+                scope = std::make_shared<const Scope>(names);
+            }
+            else if (auto rmw = std::get_if<NodeStmtRmw*>(&stmt->var))
+            {
+                check_names((*rmw)->expr, names);
+                steps.push_back(Step{.dst = nullptr, .index = nullptr, .expr = (*rmw)->expr, .names = scope});
+            }
+            else if (auto pin = std::get_if<NodeStmtPin*>(&stmt->var))
+            {
+                check_names((*pin)->cpu, names);
+                steps.push_back(Step{.dst = nullptr, .index = nullptr, .expr = (*pin)->cpu, .names = scope});
+            }
+            else if (auto await = std::get_if<NodeStmtAwait*>(&stmt->var))
+            {
+                const NodeStmtAwait *a = *await;
+                if (names.contains(a->ident.value.value()))
+                {
+                    std::cerr << "Atomic operation on a local, only globals are shared: "
+                              << a->ident.value.value() << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                global(a->ident);
+                if (a->index)
+                    check_names(a->index, names);
+                check_names(a->value, names);
+                steps.push_back(Step{.dst = nullptr, .index = a->index, .expr = a->value, .names = scope,
+                                     .await = &a->ident});
+            }
+            else if (auto repeat = std::get_if<NodeStmtRepeat*>(&stmt->var))
+            {
+                std::vector<Step> body_steps;
+                lower_block((*repeat)->body, names, slots, body_steps, worker);
+                if (body_steps.size() * (*repeat)->count > max_unrolled_steps)
+                {
+                    std::cerr << "repeat in worker " << worker->ident.value.value()
+                              << " is too long to simulate" << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                for (size_t i = 0; i < (*repeat)->count; i++)
+                    steps.insert(steps.end(), body_steps.begin(), body_steps.end());
+            }
+            else
+            {
+                std::cerr << "Simulator only supports assignments, locals, atomics, repeat, pin and await inside worker "
+                          << worker->ident.value.value() << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // zigzag varint, nearly everything in a state is a small number
+    static void put_varint(std::string &k, int64_t value)
+    {
+        uint64_t u = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        while (u >= 0x80)
+        {
+            k.push_back(static_cast<char>(u | 0x80));
+            u >>= 7;
+        }
+        k.push_back(static_cast<char>(u));
+    }
+
+    // steps run through their locals eagerly (see run_local), so `reads` only
+    // holds loads of a step that still has a shared access to go
+    static std::string key(const State &state)
+    {
+        std::string k;
+        for (int64_t value : state.mem)
+            put_varint(k, value);
+        for (const ThreadState &thread : state.threads)
+        {
+            // lengths up front so two threads can never alias into the same key
+            put_varint(k, static_cast<int64_t>(thread.pc));
+            put_varint(k, static_cast<int64_t>(thread.reads.size()));
+            put_varint(k, static_cast<int64_t>(thread.buffer.size()));
+            for (int64_t value : thread.locals)
+                put_varint(k, value);
+            for (int64_t value : thread.reads)
+                put_varint(k, value);
+            for (const auto &[loc, value] : thread.buffer)
+            {
+                put_varint(k, static_cast<int64_t>(loc));
+                put_varint(k, value);
+            }
+        }
+        return k;
+    }
+
+    // whether `state` still needs expanding. a state seen before only does
+    // when something that was asleep back then is awake now, and it goes
+    // again with what was asleep both times
+    bool insert_visited(State &state)
+    {
+        std::string k = key(state);
+        VisitedShard &shard = m_visited.at(std::hash<std::string>{}(k) % visited_shards);
+        std::lock_guard lock(shard.mutex);
+        const auto seen = shard.keys.find(k);
+        if (seen != shard.keys.end())
+        {
+            if ((seen->second & ~state.sleep) == 0)
+                return false;
+            seen->second &= state.sleep;
+            state.sleep = seen->second;
+            return true;
+        }
+        if (m_visited_count.load() >= m_max_states)
+        {
+            m_overflow = true;
+            return false;
+        }
+        shard.keys.emplace(std::move(k), state.sleep);
+        m_visited_count++;
+        return true;
+    }
+
+    static bool only_thread(const std::set<size_t> &threads, size_t t)
+    {
+        return threads.empty() || (threads.size() == 1 && threads.contains(t));
+    }
+
+    // locked instructions wait for the thread's store buffer to drain, an
+    // await waits until its load would return the value it wants
+    static bool can_access(const State &state, size_t t, const Access &access)
+    {
+        if (access.await.has_value())
+            return load(state, t, access.loc) == access.await.value();
+        return state.threads.at(t).buffer.empty() || !access.rmw.has_value();
+    }
+
+    // a load forwards from the thread's newest buffered store to that location
+    static int64_t load(const State &state, size_t t, size_t loc)
+    {
+        int64_t value = state.mem.at(loc);
+        for (const auto &[buffered_loc, buffered] : state.threads.at(t).buffer)
+            if (buffered_loc == loc)
+                value = buffered;
+        return value;
+    }
+
+    // replays the current step over the accesses done so far. either the next
+    // memory access, or nullopt with `dst`/`value` set when it is ready to store
+    std::optional<Access> next_access(const ThreadState &thread, size_t t,
+                                      size_t *dst = nullptr, int64_t *value = nullptr) const
+    {
+        const Step &step = m_threads.at(t).at(thread.pc);
+        ReadCursor cursor{.reads = thread.reads, .locals = &thread.locals, .names = step.names.get()};
+        std::optional<int64_t> index;
+        if (step.index)
+        {
+            index = eval(step.index, t, cursor);
+            if (!index.has_value())
+                return cursor.missing;
+        }
+        const std::optional<int64_t> result = eval(step.expr, t, cursor);
+        if (!result.has_value())
+            return cursor.missing;
+        if (step.await)
+            return Access{.loc = element(*step.await, index), .await = result.value()};
+        if (dst && step.dst && !step.local.has_value())
+            *dst = element(*step.dst, index);
+        if (value)
+            *value = result.value();
+        return {};
+    }
+
+    // an atomic goes straight to memory, only ever with an empty buffer
+    static int64_t access(std::vector<int64_t> &mem, const Access &access)
+    {
+        const int64_t old = mem.at(access.loc);
+        if (!access.rmw.has_value())
+            return old;
+        const Rmw &rmw = access.rmw.value();
+        if (rmw.op == RmwOp::add)
+            mem.at(access.loc) = old + rmw.value;
+        else if (rmw.op == RmwOp::swap || old == rmw.expected)
+            mem.at(access.loc) = rmw.value;
+        return old;
+    }
+
+    // finishes thread `t`'s current step with the value it computed. a store
+    // to a global no other thread touches skips the buffer, nobody could tell
+    // it from one that flushed right away and the thread reads it back the same
+    void complete(State &state, size_t t, size_t dst, int64_t value) const
+    {
+        ThreadState &thread = state.threads.at(t);
+        const Step &step = m_threads.at(t).at(thread.pc);
+        if (step.local.has_value())
+            thread.locals.at(step.local.value()) = value;
+        else if (step.dst && only_thread(m_accessors.at(dst), t))
+            state.mem.at(dst) = value;
+        else if (step.dst)
+            thread.buffer.emplace_back(dst, value);
+        thread.reads.clear();
+        thread.pc++;
+    }
+
+    // runs thread `t` through everything no other thread can observe or
+    // disturb: locals, stores into the buffer, loads of globals only it
+    // writes. those commute with every other transition, so they happen right
+    // away instead of being interleaved. stops in front of the next access
+    // another thread could race with, an atomic or an await
+    void run_local(State &state, size_t t) const
+    {
+        ThreadState &thread = state.threads.at(t);
+        while (thread.pc < m_threads.at(t).size())
+        {
+            size_t dst = 0;
+            int64_t result = 0;
+            const std::optional<Access> next = next_access(thread, t, &dst, &result);
+            if (!next.has_value())
+            {
+                complete(state, t, dst, result);
+                continue;
+            }
+            if (next->rmw.has_value() || next->await.has_value() || !only_thread(m_writers.at(next->loc), t))
+                return;
+            thread.reads.push_back(load(state, t, next->loc));
+        }
+    }
+
+    // runs thread `t` through its next access, then on through what follows locally
+    void advance(State &state, size_t t, const Access &next) const
+    {
+        ThreadState &thread = state.threads.at(t);
+        if (next.await.has_value())
+            complete(state, t, 0, 0);
+        else if (next.rmw.has_value())
+            thread.reads.push_back(access(state.mem, next));
+        else
+            thread.reads.push_back(load(state, t, next.loc));
+        run_local(state, t);
+    }
+
+    static void flush(State &state, size_t t)
+    {
+        auto &buffer = state.threads.at(t).buffer;
+        state.mem.at(buffer.front().first) = buffer.front().second;
+        buffer.erase(buffer.begin());
+    }
+
+    // what thread `t` may still do to `loc` from where `state` left it
+    [[nodiscard]] bool may_load(const State &state, size_t t, size_t loc) const
+    {
+        return m_footprints.at(t).load.at(loc) > state.threads.at(t).pc;
+    }
+
+    [[nodiscard]] bool may_rmw(const State &state, size_t t, size_t loc) const
+    {
+        return m_footprints.at(t).rmw.at(loc) > state.threads.at(t).pc;
+    }
+
+    [[nodiscard]] bool may_flush(const State &state, size_t t, size_t loc) const
+    {
+        if (m_footprints.at(t).store.at(loc) > state.threads.at(t).pc)
+            return true;
+        for (const auto &[buffered_loc, value] : state.threads.at(t).buffer)
+            if (buffered_loc == loc)
+                return true;
+        return false;
+    }
+
+    // partial-order reduction with persistent sets. every thread has two
+    // agents, agent 2t is its code (the next access) and 2t+1 its store buffer
+    // (the next flush). starting from one enabled agent, the set pulls in every
+    // agent of another thread that could, before any agent in the set moves,
+    // do something that doesn't commute with what the set does next: write a
+    // global it loads, or touch one it writes. a blocked agent also pulls in
+    // whoever can unblock it, the own buffer for an atomic, the other writers
+    // for an await, the code for an empty buffer. the two agents of a thread
+    // commute with each other (a load forwards the same value before and after
+    // its own flush). the search graph has no cycles, so expanding only the
+    // enabled agents of one such set still reaches every final state
+    std::vector<bool> persistent_set(const State &state, const std::vector<std::optional<Access>> &next,
+                                     const std::vector<bool> &enabled, size_t seed) const
+    {
+        const size_t threads = state.threads.size();
+        std::vector<bool> in(2 * threads, false);
+        std::vector<size_t> work{seed};
+        in.at(seed) = true;
+        auto add = [&in, &work](size_t agent) {
+            if (!in.at(agent))
+            {
+                in.at(agent) = true;
+                work.push_back(agent);
+            }
+        };
+        while (!work.empty())
+        {
+            const size_t agent = work.back();
+            work.pop_back();
+            const size_t t = agent / 2;
+            const ThreadState &thread = state.threads.at(t);
+            if (agent % 2 == 0)
+            {
+                if (!next.at(t).has_value())
+                    continue;
+                const Access &access = next.at(t).value();
+                if (!enabled.at(agent) && access.rmw.has_value())
+                    add(2 * t + 1);
+                const bool writes = access.rmw.has_value();
+                for (size_t q = 0; q < threads; q++)
+                {
+                    if (q == t)
+                        continue;
+                    if (may_flush(state, q, access.loc))
+                        add(2 * q + 1);
+                    if (may_rmw(state, q, access.loc) || (writes && may_load(state, q, access.loc)))
+                        add(2 * q);
+                }
+            }
+            else
+            {
+                if (thread.buffer.empty())
+                {
+                    add(2 * t);
+                    continue;
+                }
+                const size_t loc = thread.buffer.front().first;
+                for (size_t q = 0; q < threads; q++)
+                {
+                    if (q == t)
+                        continue;
+                    if (may_flush(state, q, loc))
+                        add(2 * q + 1);
+                    if (may_load(state, q, loc) || may_rmw(state, q, loc))
+                        add(2 * q);
+                }
+            }
+        }
+        return in;
+    }
+
+    // the location an enabled agent's next move touches, and whether it writes it
+    static std::pair<size_t, bool> touches(const State &state, const std::vector<std::optional<Access>> &next,
+                                           size_t agent)
+    {
+        if (agent % 2 == 1)
+            return {state.threads.at(agent / 2).buffer.front().first, true};
+        const Access &access = next.at(agent / 2).value();
+        return {access.loc, access.rmw.has_value()};
+    }
+
+    // whether two agents enabled in `state` commute. a thread's code and its
+    // own buffer always do, an atomic can't go while there is anything to flush
+    static bool independent(const State &state, const std::vector<std::optional<Access>> &next,
+                            size_t a, size_t b)
+    {
+        if (a / 2 == b / 2)
+            return true;
+        const auto [loc_a, writes_a] = touches(state, next, a);
+        const auto [loc_b, writes_b] = touches(state, next, b);
+        return loc_a != loc_b || (!writes_a && !writes_b);
+    }
+
+    static bool asleep(uint64_t sleep, size_t agent)
+    {
+        return agent < 64 && (sleep >> agent & 1) != 0;
+    }
+
+    // the expanded states of a persistent set minus whatever sleeps. every
+    // branch puts the agents of the branches before it to sleep, together
+    // with the ones already asleep, as long as they commute with its own move
+    std::vector<State> successors(const State &state) const
+    {
+        const size_t threads = state.threads.size();
+        std::vector<std::optional<Access>> next(threads);
+        std::vector<bool> enabled(2 * threads, false);
+        for (size_t t = 0; t < threads; t++)
+        {
+            const ThreadState &thread = state.threads.at(t);
+            // run_local left every unfinished thread in front of an access
+            if (thread.pc < m_threads.at(t).size())
+            {
+                next.at(t) = next_access(thread, t);
+                enabled.at(2 * t) = can_access(state, t, next.at(t).value());
+            }
+            enabled.at(2 * t + 1) = !thread.buffer.empty();
+        }
+
+        // the persistent set with the fewest enabled agents awake, one is as good as it gets
+        std::vector<bool> best;
+        size_t best_size = 0;
+        for (size_t seed = 0; seed < 2 * threads && (best.empty() || best_size > 1); seed++)
+        {
+            if (!enabled.at(seed))
+                continue;
+            std::vector<bool> set = persistent_set(state, next, enabled, seed);
+            size_t size = 0;
+            for (size_t agent = 0; agent < 2 * threads; agent++)
+                size += set.at(agent) && enabled.at(agent) && !asleep(state.sleep, agent);
+            if (best.empty() || size < best_size)
+            {
+                best = std::move(set);
+                best_size = size;
+            }
+        }
+
+        std::vector<State> states;
+        uint64_t covered = state.sleep;
+        for (size_t agent = 0; agent < best.size(); agent++)
+        {
+            if (!best.at(agent) || !enabled.at(agent) || asleep(state.sleep, agent))
+                continue;
+            State s = state;
+            if (agent % 2 == 0)
+                advance(s, agent / 2, next.at(agent / 2).value());
+            else
+                flush(s, agent / 2);
+            s.sleep = 0;
+            for (size_t other = 0; other < std::min<size_t>(2 * threads, 64); other++)
+                if (asleep(covered, other) && independent(state, next, agent, other))
+                    s.sleep |= uint64_t{1} << other;
+            if (agent < 64)
+                covered |= uint64_t{1} << agent;
+            states.push_back(std::move(s));
+        }
+        return states;
+    }
+
+    // anything left to do, asleep or not
+    bool can_move(const State &state) const
+    {
+        for (size_t t = 0; t < state.threads.size(); t++)
+        {
+            const ThreadState &thread = state.threads.at(t);
+            if (!thread.buffer.empty())
+                return true;
+            if (thread.pc < m_threads.at(t).size() && can_access(state, t, next_access(thread, t).value()))
+                return true;
+        }
+        return false;
+    }
+
+    bool finished(const State &state) const
+    {
+        for (size_t t = 0; t < state.threads.size(); t++)
+            if (state.threads.at(t).pc < m_threads.at(t).size())
+                return false;
+        return true;
+    }
+
+    std::optional<State> take(size_t id)
+    {
+        {
+            WorkQueue &own = m_queues.at(id);
+            std::lock_guard lock(own.mutex);
+            if (!own.states.empty())
+            {
+                State state = std::move(own.states.back());
+                own.states.pop_back();
+                return state;
+            }
+        }
+        for (size_t i = 1; i < m_queues.size(); i++)
+        {
+            WorkQueue &victim = m_queues.at((id + i) % m_queues.size());
+            std::lock_guard lock(victim.mutex);
+            if (!victim.states.empty())
+            {
+                State state = std::move(victim.states.front());
+                victim.states.pop_front();
+                return state;
+            }
+        }
+        return {};
+    }
+
+    void search(size_t id, const Projection &project, std::set<TsoOutcome> &outcomes)
+    {
+        while (!m_overflow)
+        {
+            std::optional<State> state = take(id);
+            if (!state.has_value())
+            {
+                // nothing to steal, done once no thread is still expanding a state
+                if (m_pending.load() == 0)
+                    return;
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::vector<State> next = successors(state.value());
+            if (next.empty() && !can_move(state.value()))
+            {
+                // every thread finished and every buffer drained, i.e. after
+                // pthread_join. a thread left over is stuck in an await
+                if (finished(state.value()))
+                    outcomes.insert(project(state->mem));
+                else
+                    m_deadlock_count++;
+            }
+            for (State &s : next)
+            {
+                if (!insert_visited(s))
+                    continue;
+                m_pending++;
+                WorkQueue &own = m_queues.at(id);
+                std::lock_guard lock(own.mutex);
+                own.states.push_back(std::move(s));
+            }
+            m_pending--;
+        }
+    }
+
+    const NodeProg m_prog;
+    std::vector<const NodeStmt*> m_main;
+    std::unordered_map<std::string, Global> m_globals;
+    // one label per location, `x` or `slot[3]`
+    std::vector<std::string> m_global_names;
+    std::unordered_map<std::string, size_t> m_labels;
+    std::vector<std::vector<Step>> m_threads;
+    // `tid` of every thread, i.e. its replica index
+    std::vector<int64_t> m_tids;
+    // local slot count of every worker, and which worker each thread runs
+    std::vector<size_t> m_local_slots;
+    std::vector<size_t> m_thread_worker;
+    std::vector<std::set<size_t>> m_writers;
+    std::vector<std::set<size_t>> m_accessors;
+    std::vector<Footprint> m_footprints;
+    size_t m_max_states;
+    std::vector<WorkQueue> m_queues;
+    std::vector<VisitedShard> m_visited;
+    std::atomic<size_t> m_visited_count = 0;
+    std::atomic<size_t> m_deadlock_count = 0;
+    std::atomic<size_t> m_pending = 0;
+    // set once the visited set hits m_max_states, every search thread then stops
+    std::atomic<bool> m_overflow = false;
+};
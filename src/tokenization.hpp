@@ -5,7 +5,9 @@
 
 // hydrogen language tokens
 enum class TokenType
-{exit, open_paren, close_paren, eq, plus, int_lit, ident, global, let, start, semi, pipe};
+{exit, open_paren, close_paren, eq, plus, int_lit, ident, global, let, start, semi, pipe, print, report, comma,
+ open_bracket, close_bracket, tid, plus_eq, atomic, cas, swap, repeat, open_curly, close_curly, pin, await,
+ rdtscp};
 
 struct Token
 {
@@ -58,6 +60,56 @@ public:
                     tokens.push_back({.type = TokenType::start});
                     buf.clear();
                 }
+                else if (buf == "print")
+                {
+                    tokens.push_back({.type = TokenType::print});
+                    buf.clear();
+                }
+                else if (buf == "report")
+                {
+                    tokens.push_back({.type = TokenType::report});
+                    buf.clear();
+                }
+                else if (buf == "tid")
+                {
+                    tokens.push_back({.type = TokenType::tid});
+                    buf.clear();
+                }
+                else if (buf == "atomic")
+                {
+                    tokens.push_back({.type = TokenType::atomic});
+                    buf.clear();
+                }
+                else if (buf == "cas")
+                {
+                    tokens.push_back({.type = TokenType::cas});
+                    buf.clear();
+                }
+                else if (buf == "swap")
+                {
+                    tokens.push_back({.type = TokenType::swap});
+                    buf.clear();
+                }
+                else if (buf == "repeat")
+                {
+                    tokens.push_back({.type = TokenType::repeat});
+                    buf.clear();
+                }
+                else if (buf == "pin")
+                {
+                    tokens.push_back({.type = TokenType::pin});
+                    buf.clear();
+                }
+                else if (buf == "await")
+                {
+                    tokens.push_back({.type = TokenType::await});
+                    buf.clear();
+                }
+                else if (buf == "rdtscp")
+                {
+                    tokens.push_back({.type = TokenType::rdtscp});
+                    buf.clear();
+                }
                 else
                 {
                     tokens.push_back({.type = TokenType::ident, .value = buf});
@@ -77,6 +129,12 @@ public:
                 consume();
                 tokens.push_back({.type = TokenType::eq});
             }
+            else if (peek().value() == '+' && peek(1).has_value() && peek(1).value() == '=')
+            {
+                consume();
+                consume();
+                tokens.push_back({.type = TokenType::plus_eq});
+            }
             else if (peek().value() == '+')
             {
                 consume();
@@ -92,6 +150,31 @@ public:
                 consume();
                 tokens.push_back({.type = TokenType::close_paren});
             }
+            else if (peek().value() == '[')
+            {
+                consume();
+                tokens.push_back({.type = TokenType::open_bracket});
+            }
+            else if (peek().value() == ']')
+            {
+                consume();
+                tokens.push_back({.type = TokenType::close_bracket});
+            }
+            else if (peek().value() == '{')
+            {
+                consume();
+                tokens.push_back({.type = TokenType::open_curly});
+            }
+            else if (peek().value() == '}')
+            {
+                consume();
+                tokens.push_back({.type = TokenType::close_curly});
+            }
+            else if (peek().value() == ',')
+            {
+                consume();
+                tokens.push_back({.type = TokenType::comma});
+            }
             else if (peek().value() == ';')
             {
                 consume();
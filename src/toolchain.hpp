@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./generation.hpp"
+#include "./pass_timer.hpp"
+
+extern char **environ;
+
+// runs a `.hy` source through the whole pipeline and hands back the NASM text.
+// the parser owns the arena the AST lives in, so it has to outlive the generator.
+// with a timer every phase is timed and the AST/output sizes are counted
+inline std::string compile_to_asm(std::string src, ReportFormat format = ReportFormat::text,
+                                  PassTimer *timer = nullptr, CodeLayout layout = {})
+{
+    using namespace std;
+    const auto phase = [timer](const string &name, const function<void()> &fn) {
+        if (timer)
+            timer->time(name, fn);
+        else
+            fn();
+    };
+
+    vector<Token> tokens;
+    phase("tokenize", [&] { tokens = Tokenizer(move(src)).tokenize(); });
+    const size_t token_count = tokens.size();
+
+    Parser parser(move(tokens));
+    optional<NodeProg> prog;
+    phase("parse", [&] { prog = parser.parse_prog(); });
+
+    if (!prog.has_value())
+    {
+        cerr << "Invalid Program" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    string asm_src;
+    phase("generate", [&] { asm_src = Generator(prog.value(), format, layout).gen_prog(); });
+
+    if (timer)
+    {
+        timer->count("tokens", token_count);
+        timer->count("ast_nodes", parser.allocator().allocations());
+        timer->count("arena_high_water", parser.allocator().high_water());
+        timer->count("arena_capacity", parser.allocator().capacity());
+        timer->count("asm_bytes", asm_src.size());
+    }
+    return asm_src;
+}
+
+// same nasm + gcc commands the driver has always used, just with configurable paths.
+// `huge_pages` lines the segments up on 2 MiB so the kernel can map text with huge pages
+inline bool assemble_and_link(const std::string &asm_path, const std::string &obj_path, const std::string &bin_path,
+                              PassTimer *timer = nullptr, bool huge_pages = false)
+{
+    const std::string nasm = "nasm -felf64 " + asm_path + " -o " + obj_path;
+    std::string gcc = "gcc -no-pie -o " + bin_path + " " + obj_path + " -pthread";
+    if (huge_pages)
+        gcc += " -Wl,-zcommon-page-size=2097152 -Wl,-zmax-page-size=2097152";
+    if (!timer)
+        return system(nasm.c_str()) == 0 && system(gcc.c_str()) == 0;
+
+    bool ok = false;
+    timer->time("nasm", [&] { ok = system(nasm.c_str()) == 0; });
+    if (!ok)
+        return false;
+    timer->time("gcc", [&] { ok = system(gcc.c_str()) == 0; });
+
+    std::error_code ec;
+    const uintmax_t obj_bytes = std::filesystem::file_size(obj_path, ec);
+    if (!ec)
+        timer->count("object_bytes", obj_bytes);
+    const uintmax_t bin_bytes = std::filesystem::file_size(bin_path, ec);
+    if (ok && !ec)
+        timer->count("binary_bytes", bin_bytes);
+    return ok;
+}
+
+// execs a binary once and returns everything it wrote to stdout,
+// or nothing if it could not be started or did not exit cleanly
+inline std::optional<std::string> run_capture(const std::string &bin_path)
+{
+    // O_CLOEXEC so binaries spawned by other litmus jobs don't hold our write
+    // end open, adddup2 clears it again on the child's stdout
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        return {};
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+
+    pid_t pid;
+    char *argv[] = {const_cast<char*>(bin_path.c_str()), nullptr};
+    const int err = posix_spawn(&pid, bin_path.c_str(), &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err != 0)
+    {
+        close(fds[0]);
+        return {};
+    }
+
+    std::string output;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+        output.append(buf, n);
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return {};
+    return output;
+}
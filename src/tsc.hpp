@@ -0,0 +1,23 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <x86intrin.h>
+
+// ticks per ns of the time stamp counter rdtscp() reads. it counts at a fixed
+// rate, so it is measured once against the steady clock and reused
+inline double tsc_ghz()
+{
+    static const double ghz = [] {
+        using namespace std::chrono;
+        const auto begin = steady_clock::now();
+        const uint64_t start = __rdtsc();
+        while (steady_clock::now() - begin < milliseconds(50))
+            ;
+        const uint64_t cycles = __rdtsc() - start;
+        const double ns = static_cast<double>(duration_cast<nanoseconds>(steady_clock::now() - begin).count());
+        return static_cast<double>(cycles) / ns;
+    }();
+    return ghz;
+}